@@ -0,0 +1,118 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+
+#define MAX_THREADS 48
+#define OPS         200000
+#define WRITE_EVERY 10000
+
+tbthread_rwlock_t rwlock = TBTHREAD_RWLOCK_INIT;
+tbthread_brlock_t brlock = TBTHREAD_BRLOCK_INIT;
+int table[16];
+int go = 0;
+
+//------------------------------------------------------------------------------
+// Thread functions, read mostly with an occasional write
+//------------------------------------------------------------------------------
+void *rwlock_func(void *arg)
+{
+  uint64_t sum = 0;
+  while(!__atomic_load_n(&go, __ATOMIC_ACQUIRE));
+  for(int i = 1; i <= OPS; ++i) {
+    if(i % WRITE_EVERY == 0) {
+      tbthread_rwlock_wrlock(&rwlock);
+      ++table[i % 16];
+      tbthread_rwlock_unlock(&rwlock);
+      continue;
+    }
+    tbthread_rwlock_rdlock(&rwlock);
+    sum += table[i % 16];
+    tbthread_rwlock_unlock(&rwlock);
+  }
+  return (void *)sum;
+}
+
+void *brlock_func(void *arg)
+{
+  uint64_t sum = 0;
+  while(!__atomic_load_n(&go, __ATOMIC_ACQUIRE));
+  for(int i = 1; i <= OPS; ++i) {
+    if(i % WRITE_EVERY == 0) {
+      tbthread_brlock_wrlock(&brlock);
+      ++table[i % 16];
+      tbthread_brlock_unlock(&brlock);
+      continue;
+    }
+    tbthread_brlock_rdlock(&brlock);
+    sum += table[i % 16];
+    tbthread_brlock_unlock(&brlock);
+  }
+  return (void *)sum;
+}
+
+//------------------------------------------------------------------------------
+// Run the threads and measure the time per operation
+//------------------------------------------------------------------------------
+int run(const char *name, void *(*func)(void *), int num_threads)
+{
+  tbthread_t      thread[MAX_THREADS];
+  tbthread_attr_t attr;
+  int             st = 0;
+
+  go = 0;
+  tbthread_attr_init(&attr);
+  for(int i = 0; i < num_threads; ++i) {
+    st = tbthread_create(&thread[i], &attr, func, 0);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      return st;
+    }
+  }
+
+  uint64_t start = tbtime_ns();
+  __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+  for(int i = 0; i < num_threads; ++i)
+    tbthread_join(thread[i], 0);
+  uint64_t elapsed = tbtime_ns() - start;
+
+  tbprint("%s, %d threads: %llu ns total, %llu ns per operation\n", name,
+          num_threads, elapsed, elapsed / ((uint64_t)num_threads * OPS));
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  int counts[] = {1, 2, 4, 8, 16, 32, MAX_THREADS};
+  int st = 0;
+  for(int i = 0; i < sizeof(counts)/sizeof(int); ++i) {
+    if((st = run("tbthread_rwlock_t", rwlock_func, counts[i])))
+      break;
+    if((st = run("tbthread_brlock_t", brlock_func, counts[i])))
+      break;
+  }
+
+  tbthread_finit();
+  return st;
+};
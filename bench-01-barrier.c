@@ -0,0 +1,97 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+
+#define MAX_THREADS 32
+#define ROUNDS      1000
+
+tbthread_barrier_t barrier;
+int go = 0;
+
+//------------------------------------------------------------------------------
+// Thread function
+//------------------------------------------------------------------------------
+void *thread_func(void *arg)
+{
+  uint32_t id = *(int *)arg;
+  while(!__atomic_load_n(&go, __ATOMIC_ACQUIRE));
+  for(int i = 0; i < ROUNDS; ++i)
+    tbthread_barrier_wait_id(&barrier, id);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Run the threads and measure the time per barrier phase
+//------------------------------------------------------------------------------
+int run(const char *name, int kind, int num_threads)
+{
+  tbthread_t             thread[MAX_THREADS];
+  int                    targ[MAX_THREADS];
+  tbthread_attr_t        attr;
+  tbthread_barrierattr_t battr;
+  int                    st = 0;
+
+  tbthread_barrierattr_init(&battr);
+  tbthread_barrierattr_setkind(&battr, kind);
+  if((st = tbthread_barrier_init(&barrier, &battr, num_threads)))
+    return st;
+
+  go = 0;
+  tbthread_attr_init(&attr);
+  for(int i = 0; i < num_threads; ++i) {
+    targ[i] = i;
+    st = tbthread_create(&thread[i], &attr, thread_func, &targ[i]);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      return st;
+    }
+  }
+
+  uint64_t start = tbtime_ns();
+  __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+  for(int i = 0; i < num_threads; ++i)
+    tbthread_join(thread[i], 0);
+  uint64_t elapsed = tbtime_ns() - start;
+  tbthread_barrier_destroy(&barrier);
+
+  tbprint("%s, %d threads: %llu ns total, %llu ns per phase\n", name,
+          num_threads, elapsed, elapsed / ROUNDS);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  int counts[] = {1, 2, 4, 8, 16, MAX_THREADS};
+  int st = 0;
+  for(int i = 0; i < sizeof(counts)/sizeof(int); ++i) {
+    if((st = run("central", TBTHREAD_BARRIER_CENTRAL, counts[i])))
+      break;
+    if((st = run("tree", TBTHREAD_BARRIER_TREE, counts[i])))
+      break;
+  }
+
+  tbthread_finit();
+  return st;
+};
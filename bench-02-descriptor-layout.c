@@ -0,0 +1,145 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <linux/time.h>
+
+#define NUM_REMOTE 3
+#define ITERATIONS 2000000
+
+tbthread_t target;
+int go = 0;
+int stop = 0;
+int target_ready = 0;
+uint64_t elapsed;
+
+//------------------------------------------------------------------------------
+// The CPU time of the calling thread, so that the time the remote threads
+// spend on the CPU is not counted when they share it with the target
+//------------------------------------------------------------------------------
+uint64_t thread_time_ns()
+{
+  struct timespec ts;
+  SYSCALL2(__NR_clock_gettime, CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//------------------------------------------------------------------------------
+// The target thread only touches the fields of its own descriptor that it
+// writes itself
+//------------------------------------------------------------------------------
+void *target_func(void *arg)
+{
+  int value;
+  tbthread_setcancelstate(TBTHREAD_CANCEL_DISABLE, 0);
+  __atomic_store_n(&target_ready, 1, __ATOMIC_RELEASE);
+  while(!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+    SYSCALL0(__NR_sched_yield);
+
+  uint64_t start = thread_time_ns();
+  for(int i = 0; i < ITERATIONS; ++i) {
+    tb_rcu_read_lock();
+    tb_hazard_set(0, &value);
+    tb_hazard_clear(0);
+    tb_rcu_read_unlock();
+  }
+  elapsed = thread_time_ns() - start;
+  __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// The remote threads hammer the target's descriptor: setting the scheduling
+// parameters looks the descriptor up, takes and releases its lock and stores
+// the user scheduling info, so every call writes the line holding the fields
+// that the other threads update, like the priority inheritance does when a
+// waiter boosts the owner of a mutex
+//------------------------------------------------------------------------------
+void *remote_func(void *arg)
+{
+  while(!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+    SYSCALL0(__NR_sched_yield);
+
+  while(!__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+    tbthread_setschedparam(target, SCHED_NORMAL, 0);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Run the target with or without the remote threads
+//------------------------------------------------------------------------------
+int run(const char *name, int num_remote)
+{
+  tbthread_t      thread[NUM_REMOTE];
+  tbthread_attr_t attr;
+  int             st = 0;
+
+  go = 0;
+  stop = 0;
+  target_ready = 0;
+  tbthread_attr_init(&attr);
+  if((st = tbthread_create(&target, &attr, target_func, 0))) {
+    tbprint("Failed to spawn the target: %s\n", tbstrerror(-st));
+    return st;
+  }
+  while(!__atomic_load_n(&target_ready, __ATOMIC_ACQUIRE))
+    SYSCALL0(__NR_sched_yield);
+
+  for(int i = 0; i < num_remote; ++i) {
+    st = tbthread_create(&thread[i], &attr, remote_func, 0);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      return st;
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // The remote threads use the handle of the target, so it needs to stay
+  // valid until they are gone
+  //----------------------------------------------------------------------------
+  __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+  for(int i = 0; i < num_remote; ++i)
+    tbthread_join(thread[i], 0);
+  tbthread_join(target, 0);
+
+  tbprint("%s: %llu ns of CPU time, %llu ps per iteration\n", name, elapsed,
+          elapsed * 1000 / ITERATIONS);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+#ifdef TB_PACKED_DESCRIPTOR
+  tbprint("Packed descriptor layout\n");
+#else
+  tbprint("Descriptor layout grouped by writer\n");
+#endif
+
+  int st = 0;
+  if(!st) st = run("quiet", 0);
+  if(!st) st = run("remote setschedparam", NUM_REMOTE);
+
+  tbthread_finit();
+  return st;
+};
@@ -0,0 +1,240 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+#include <limits.h>
+#include <string.h>
+#include <linux/futex.h>
+
+//------------------------------------------------------------------------------
+// Barriers. The threads of the current phase wait for the release sequence
+// to change. In the central mode everybody counts down on the same word and
+// the last one to arrive releases the others. In the tree mode, the threads
+// arrive at the leaves of a combining tree with the fan-in of four; only the
+// last one to arrive at a node goes up to the parent, so no cache line is
+// hit by more than four threads. The waiters spin for a while before going
+// to sleep.
+//------------------------------------------------------------------------------
+#define BARRIER_FANIN 4
+#define BARRIER_DEFAULT_SPIN 100
+
+struct barrier_node {
+  uint32_t count;
+  uint32_t remaining;
+  uint32_t parent;
+} __attribute__((aligned(64)));
+
+#define BARRIER_ROOT 0xffffffff
+
+//------------------------------------------------------------------------------
+// Init attributes
+//------------------------------------------------------------------------------
+int tbthread_barrierattr_init(tbthread_barrierattr_t *attr)
+{
+  memset(attr, 0, sizeof(tbthread_barrierattr_t));
+  attr->kind = TBTHREAD_BARRIER_CENTRAL;
+  attr->spin = BARRIER_DEFAULT_SPIN;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy attributes - no op
+//------------------------------------------------------------------------------
+int tbthread_barrierattr_destroy(tbthread_barrierattr_t *attr)
+{
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Set the kind
+//------------------------------------------------------------------------------
+int tbthread_barrierattr_setkind(tbthread_barrierattr_t *attr, int kind)
+{
+  if(kind != TBTHREAD_BARRIER_CENTRAL && kind != TBTHREAD_BARRIER_TREE)
+    return -EINVAL;
+  attr->kind = kind;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Set the number of spins before parking
+//------------------------------------------------------------------------------
+int tbthread_barrierattr_setspin(tbthread_barrierattr_t *attr, uint32_t spin)
+{
+  attr->spin = spin;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Build the combining tree; the nodes of each level follow the nodes of the
+// level below
+//------------------------------------------------------------------------------
+static struct barrier_node *build_tree(uint32_t count)
+{
+  uint32_t num_nodes = 0;
+  for(uint32_t n = count; n > 1; n = (n + BARRIER_FANIN - 1) / BARRIER_FANIN)
+    num_nodes += (n + BARRIER_FANIN - 1) / BARRIER_FANIN;
+  if(!num_nodes)
+    num_nodes = 1;
+
+  //----------------------------------------------------------------------------
+  // Our malloc aligns to 8 bytes only, so we align the nodes by hand and keep
+  // the original pointer in front of the array
+  //----------------------------------------------------------------------------
+  void *mem = malloc(num_nodes * sizeof(struct barrier_node) + 64);
+  if(!mem)
+    return 0;
+  struct barrier_node *nodes = (void *)(((uint64_t)mem + 64) & ~63ULL);
+  ((void **)nodes)[-1] = mem;
+
+  uint32_t offset = 0;
+  uint32_t n = count;
+  do {
+    uint32_t level = (n + BARRIER_FANIN - 1) / BARRIER_FANIN;
+    for(uint32_t i = 0; i < level; ++i) {
+      struct barrier_node *node = &nodes[offset + i];
+      node->count = n - i * BARRIER_FANIN;
+      if(node->count > BARRIER_FANIN)
+        node->count = BARRIER_FANIN;
+      node->remaining = node->count;
+      node->parent = BARRIER_ROOT;
+      if(level > 1)
+        node->parent = offset + level + i / BARRIER_FANIN;
+    }
+    offset += level;
+    n = level;
+  } while(n > 1);
+  return nodes;
+}
+
+//------------------------------------------------------------------------------
+// Initialize the barrier
+//------------------------------------------------------------------------------
+int tbthread_barrier_init(tbthread_barrier_t *barrier,
+  const tbthread_barrierattr_t *attr, uint32_t count)
+{
+  if(count == 0)
+    return -EINVAL;
+
+  memset(barrier, 0, sizeof(tbthread_barrier_t));
+  barrier->count = count;
+  barrier->remaining = count;
+  barrier->kind = TBTHREAD_BARRIER_CENTRAL;
+  barrier->spin = BARRIER_DEFAULT_SPIN;
+  if(attr) {
+    barrier->kind = attr->kind;
+    barrier->spin = attr->spin;
+  }
+
+  if(barrier->kind == TBTHREAD_BARRIER_TREE) {
+    barrier->tree = build_tree(count);
+    if(!barrier->tree)
+      return -ENOMEM;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy the barrier
+//------------------------------------------------------------------------------
+int tbthread_barrier_destroy(tbthread_barrier_t *barrier)
+{
+  if(barrier->tree)
+    free(((void **)barrier->tree)[-1]);
+  barrier->tree = 0;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Release the waiters of the phase
+//------------------------------------------------------------------------------
+static int release(tbthread_barrier_t *barrier)
+{
+  __sync_fetch_and_add(&barrier->seq, 1);
+  if(barrier->sleepers)
+    SYSCALL3(__NR_futex, &barrier->seq, FUTEX_WAKE, INT_MAX);
+  return TBTHREAD_BARRIER_SERIAL_THREAD;
+}
+
+//------------------------------------------------------------------------------
+// Wait for the phase to end
+//------------------------------------------------------------------------------
+static int wait_release(tbthread_barrier_t *barrier, int seq)
+{
+  for(uint32_t i = 0; i < barrier->spin; ++i) {
+    if(__atomic_load_n(&barrier->seq, __ATOMIC_ACQUIRE) != seq)
+      return 0;
+    asm volatile("pause" ::: "memory");
+  }
+
+  __sync_fetch_and_add(&barrier->sleepers, 1);
+  while(__atomic_load_n(&barrier->seq, __ATOMIC_ACQUIRE) == seq)
+    SYSCALL3(__NR_futex, &barrier->seq, FUTEX_WAIT, seq);
+  __sync_fetch_and_sub(&barrier->sleepers, 1);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Wait at the barrier as the thread number id; in the tree mode, the ids of
+// the threads of a phase need to be distinct and smaller than the count
+//------------------------------------------------------------------------------
+int tbthread_barrier_wait_id(tbthread_barrier_t *barrier, uint32_t id)
+{
+  int seq = __atomic_load_n(&barrier->seq, __ATOMIC_ACQUIRE);
+
+  if(barrier->kind == TBTHREAD_BARRIER_CENTRAL) {
+    if(__sync_sub_and_fetch(&barrier->remaining, 1))
+      return wait_release(barrier, seq);
+    barrier->remaining = barrier->count;
+    return release(barrier);
+  }
+
+  if(id >= barrier->count)
+    return -EINVAL;
+
+  struct barrier_node *nodes = barrier->tree;
+  uint32_t index = id / BARRIER_FANIN;
+  while(1) {
+    struct barrier_node *node = &nodes[index];
+    if(__sync_sub_and_fetch(&node->remaining, 1))
+      return wait_release(barrier, seq);
+    node->remaining = node->count;
+    if(node->parent == BARRIER_ROOT) {
+      __atomic_store_n(&barrier->ticket, 0, __ATOMIC_RELAXED);
+      return release(barrier);
+    }
+    index = node->parent;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Wait at the barrier; in the tree mode we need to come up with an id. The
+// tickets of a phase go from zero to count-1 because no thread can start the
+// next phase before the current one is complete, and the thread completing
+// it resets the ticket before releasing the others.
+//------------------------------------------------------------------------------
+int tbthread_barrier_wait(tbthread_barrier_t *barrier)
+{
+  uint32_t id = 0;
+  if(barrier->kind == TBTHREAD_BARRIER_TREE)
+    id = __sync_fetch_and_add(&barrier->ticket, 1);
+  return tbthread_barrier_wait_id(barrier, id);
+}
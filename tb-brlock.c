@@ -0,0 +1,127 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+//------------------------------------------------------------------------------
+// Reader-biased lock in the style of BRAVO. While the lock is biased towards
+// the readers, they don't touch the lock at all; instead, they publish the
+// address of the lock in a slot of a global table chosen by hashing their
+// descriptor and the lock. A writer first takes the underlying rwlock, which
+// stops the slow path readers, then revokes the bias and waits until no
+// slot points to the lock anymore. The revocation is expensive, so the bias
+// is not restored until a multiple of the time it took has passed.
+//------------------------------------------------------------------------------
+#define BR_SLOTS       1024
+#define BR_INHIBIT_MUL 9
+
+struct br_slot {
+  tbthread_brlock_t *lock;
+  struct tbthread   *owner;
+} __attribute__((aligned(64)));
+
+static struct br_slot visible_readers[BR_SLOTS];
+
+//------------------------------------------------------------------------------
+// Find the slot for this thread and lock
+//------------------------------------------------------------------------------
+static struct br_slot *get_slot(tbthread_brlock_t *lock,
+  struct tbthread *thread)
+{
+  uint64_t hash = ((uint64_t)lock ^ ((uint64_t)thread >> 4));
+  hash *= 0x9e3779b97f4a7c15ULL;
+  return &visible_readers[hash >> 54];
+}
+
+//------------------------------------------------------------------------------
+// Initialize the lock
+//------------------------------------------------------------------------------
+int tbthread_brlock_init(tbthread_brlock_t *lock)
+{
+  tbthread_rwlock_init(&lock->rwlock, 0);
+  lock->rbias = 1;
+  lock->inhibit_until = 0;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy the lock
+//------------------------------------------------------------------------------
+int tbthread_brlock_destroy(tbthread_brlock_t *lock)
+{
+  return tbthread_rwlock_destroy(&lock->rwlock);
+}
+
+//------------------------------------------------------------------------------
+// Lock for reading
+//------------------------------------------------------------------------------
+int tbthread_brlock_rdlock(tbthread_brlock_t *lock)
+{
+  struct tbthread *self = tb_self();
+  if(lock->rbias) {
+    struct br_slot *slot = get_slot(lock, self);
+    if(__sync_bool_compare_and_swap(&slot->lock, 0, lock)) {
+      slot->owner = self;
+      if(__atomic_load_n(&lock->rbias, __ATOMIC_SEQ_CST))
+        return 0;
+      slot->owner = 0;
+      __atomic_store_n(&slot->lock, 0, __ATOMIC_RELEASE);
+    }
+  }
+
+  int st = tbthread_rwlock_rdlock(&lock->rwlock);
+  if(st == 0 && !lock->rbias && tbtime_ns() >= lock->inhibit_until)
+    lock->rbias = 1;
+  return st;
+}
+
+//------------------------------------------------------------------------------
+// Lock for writing
+//------------------------------------------------------------------------------
+int tbthread_brlock_wrlock(tbthread_brlock_t *lock)
+{
+  int st = tbthread_rwlock_wrlock(&lock->rwlock);
+  if(st || !lock->rbias)
+    return st;
+
+  __atomic_store_n(&lock->rbias, 0, __ATOMIC_SEQ_CST);
+  uint64_t start = tbtime_ns();
+  for(int i = 0; i < BR_SLOTS; ++i)
+    while(__atomic_load_n(&visible_readers[i].lock, __ATOMIC_ACQUIRE) == lock)
+      SYSCALL0(__NR_sched_yield);
+  uint64_t now = tbtime_ns();
+  lock->inhibit_until = now + (now - start) * BR_INHIBIT_MUL;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Unlock
+//------------------------------------------------------------------------------
+int tbthread_brlock_unlock(tbthread_brlock_t *lock)
+{
+  struct tbthread *self = tb_self();
+  struct br_slot *slot = get_slot(lock, self);
+  if(slot->lock == lock && slot->owner == self) {
+    slot->owner = 0;
+    __atomic_store_n(&slot->lock, 0, __ATOMIC_RELEASE);
+    return 0;
+  }
+  return tbthread_rwlock_unlock(&lock->rwlock);
+}
@@ -0,0 +1,175 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+#include <limits.h>
+
+//------------------------------------------------------------------------------
+// Locks that keep no waiter state of their own and park in the parking lot
+// when contended. The byte lock has a bit saying that it is locked and a bit
+// saying that somebody may be parked on it; the unlocker only visits the
+// parking lot when the latter is set. The bit lock is a single bit in any
+// word of the user's choice, so it cannot tell if anybody is parked; the
+// unlocker asks the parking lot, which costs a load when nobody is.
+//------------------------------------------------------------------------------
+#define BYTE_LOCKED 0x01
+#define BYTE_PARKED 0x02
+#define LOCK_SPINS  40
+
+//------------------------------------------------------------------------------
+// Park only if the lock is still locked and marked as parked
+//------------------------------------------------------------------------------
+static int bytelock_validate(void *arg)
+{
+  tbthread_bytelock_t *lock = arg;
+  return __atomic_load_n(&lock->state, __ATOMIC_RELAXED) ==
+    (BYTE_LOCKED | BYTE_PARKED);
+}
+
+//------------------------------------------------------------------------------
+// Release the lock, keeping the parked bit if anybody is still there
+//------------------------------------------------------------------------------
+static void bytelock_unparked(void *arg, int count, int more)
+{
+  tbthread_bytelock_t *lock = arg;
+  __atomic_store_n(&lock->state, more ? BYTE_PARKED : 0, __ATOMIC_RELEASE);
+}
+
+//------------------------------------------------------------------------------
+// Lock the byte lock
+//------------------------------------------------------------------------------
+int tbthread_bytelock_lock(tbthread_bytelock_t *lock)
+{
+  if(__sync_bool_compare_and_swap(&lock->state, 0, BYTE_LOCKED))
+    return 0;
+
+  int spins = 0;
+  while(1) {
+    uint8_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    if(!(state & BYTE_LOCKED)) {
+      if(__sync_bool_compare_and_swap(&lock->state, state,
+                                      state | BYTE_LOCKED))
+        return 0;
+      continue;
+    }
+
+    if(!(state & BYTE_PARKED) && spins < LOCK_SPINS) {
+      ++spins;
+      asm volatile("pause" ::: "memory");
+      continue;
+    }
+
+    if(!(state & BYTE_PARKED) &&
+       !__sync_bool_compare_and_swap(&lock->state, state,
+                                     state | BYTE_PARKED))
+      continue;
+
+    tb_park(&lock->state, bytelock_validate, lock);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Try to lock the byte lock
+//------------------------------------------------------------------------------
+int tbthread_bytelock_trylock(tbthread_bytelock_t *lock)
+{
+  uint8_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+  while(!(state & BYTE_LOCKED)) {
+    if(__sync_bool_compare_and_swap(&lock->state, state, state | BYTE_LOCKED))
+      return 0;
+    state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+  }
+  return -EBUSY;
+}
+
+//------------------------------------------------------------------------------
+// Unlock the byte lock
+//------------------------------------------------------------------------------
+int tbthread_bytelock_unlock(tbthread_bytelock_t *lock)
+{
+  if(!(lock->state & BYTE_LOCKED))
+    return -EPERM;
+  if(__sync_bool_compare_and_swap(&lock->state, BYTE_LOCKED, 0))
+    return 0;
+  tb_unpark(&lock->state, 1, bytelock_unparked, lock);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Park only if the bit is still set
+//------------------------------------------------------------------------------
+struct bitlock {
+  uint32_t *word;
+  uint32_t  mask;
+};
+
+static int bitlock_validate(void *arg)
+{
+  struct bitlock *bl = arg;
+  return __atomic_load_n(bl->word, __ATOMIC_RELAXED) & bl->mask;
+}
+
+//------------------------------------------------------------------------------
+// Lock the bit
+//------------------------------------------------------------------------------
+int tbthread_bitlock_lock(uint32_t *word, int bit)
+{
+  if(bit < 0 || bit > 31)
+    return -EINVAL;
+
+  struct bitlock bl = {word, 1U << bit};
+  int spins = 0;
+  while(__sync_fetch_and_or(word, bl.mask) & bl.mask) {
+    if(spins < LOCK_SPINS) {
+      ++spins;
+      asm volatile("pause" ::: "memory");
+      continue;
+    }
+    tb_park(word, bitlock_validate, &bl);
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Try to lock the bit
+//------------------------------------------------------------------------------
+int tbthread_bitlock_trylock(uint32_t *word, int bit)
+{
+  if(bit < 0 || bit > 31)
+    return -EINVAL;
+  if(__sync_fetch_and_or(word, 1U << bit) & (1U << bit))
+    return -EBUSY;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Unlock the bit; all the waiters parked on the word get woken up, because
+// they may be waiting for other bits
+//------------------------------------------------------------------------------
+int tbthread_bitlock_unlock(uint32_t *word, int bit)
+{
+  if(bit < 0 || bit > 31)
+    return -EINVAL;
+  if(!(__sync_fetch_and_and(word, ~(1U << bit)) & (1U << bit)))
+    return -EPERM;
+  tb_unpark(word, INT_MAX, 0, 0);
+  return 0;
+}
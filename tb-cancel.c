@@ -28,7 +28,7 @@ void tb_cancel_handler(int sig, siginfo_t *si, void *ctx)
   if(sig != SIGCANCEL || si->si_pid != tb_pid || si->si_code != SI_TKILL)
     return;
 
-  tbthread_t self = tbthread_self();
+  struct tbthread *self = tb_self();
   if(self->cancel_status & TB_CANCEL_DEFERRED)
     return;
 
@@ -38,21 +38,17 @@ void tb_cancel_handler(int sig, siginfo_t *si, void *ctx)
 //------------------------------------------------------------------------------
 // Cancel a thread
 //------------------------------------------------------------------------------
-int tbthread_cancel(tbthread_t thread)
+int tbthread_cancel(tbthread_t handle)
 {
-  int ret = 0;
-  tbthread_mutex_lock(&desc_mutex);
-
-  if(!list_find_elem(&used_desc, thread)) {
-    ret = -ESRCH;
-    goto exit;
-  }
+  struct tbthread *thread = tb_desc_lookup(handle);
+  if(!thread)
+    return -ESRCH;
 
   uint8_t val, newval;
   while(1) {
     newval = val = thread->cancel_status;
     if(val & TB_CANCELING)
-      goto exit;
+      return 0;
 
     newval |= TB_CANCELING;
     if(__sync_bool_compare_and_swap(&thread->cancel_status, val, newval))
@@ -60,10 +56,7 @@ int tbthread_cancel(tbthread_t thread)
   }
   if((val & TB_CANCEL_ENABLED) && !(val & TB_CANCEL_DEFERRED))
     SYSCALL3(__NR_tgkill, tb_pid, thread->tid, SIGCANCEL);
-
-exit:
-  tbthread_mutex_unlock(&desc_mutex);
-  return ret;
+  return 0;
 }
 
 //------------------------------------------------------------------------------
@@ -96,7 +89,7 @@ static void call_cleanup_handler(void *element)
 //------------------------------------------------------------------------------
 void tb_clear_cleanup_handlers()
 {
-  tbthread_t self = tbthread_self();
+  struct tbthread *self = tb_self();
   list_for_each_elem(&self->cleanup_handlers, release_cleanup_handler);
   list_clear(&self->cleanup_handlers);
 }
@@ -106,7 +99,7 @@ void tb_clear_cleanup_handlers()
 //------------------------------------------------------------------------------
 void tb_call_cleanup_handlers()
 {
-  tbthread_t self = tbthread_self();
+  struct tbthread *self = tb_self();
   list_for_each_elem(&self->cleanup_handlers, call_cleanup_handler);
   list_for_each_elem(&self->cleanup_handlers, release_cleanup_handler);
   list_clear(&self->cleanup_handlers);
@@ -117,7 +110,7 @@ void tb_call_cleanup_handlers()
 //------------------------------------------------------------------------------
 void tbthread_cleanup_push(void (*func)(void *), void *arg)
 {
-  tbthread_t self = tbthread_self();
+  struct tbthread *self = tb_self();
   struct cleanup_elem *e = malloc(sizeof(struct cleanup_elem));
   e->func = func;
   e->arg = arg;
@@ -129,7 +122,7 @@ void tbthread_cleanup_push(void (*func)(void *), void *arg)
 //------------------------------------------------------------------------------
 void tbthread_cleanup_pop(int execute)
 {
-  tbthread_t self = tbthread_self();
+  struct tbthread *self = tb_self();
   list_t *node = self->cleanup_handlers.next;
   if(!node)
     return;
@@ -146,7 +139,7 @@ void tbthread_cleanup_pop(int execute)
 //------------------------------------------------------------------------------
 static int set_cancelation_bit(int bitmask, int value)
 {
-  tbthread_t thread = tbthread_self();
+  struct tbthread *thread = tb_self();
   int val, newval, oldbit;
   while(1) {
     newval = val = thread->cancel_status;
@@ -201,7 +194,7 @@ int tbthread_setcanceltype(int type, int *oldtype)
 //------------------------------------------------------------------------------
 void tbthread_testcancel()
 {
-  tbthread_t thread = tbthread_self();
+  struct tbthread *thread = tb_self();
   uint8_t val, newval;
 
   while(1) {
@@ -21,21 +21,193 @@
 #include "tb-private.h"
 
 #include <limits.h>
+#include <string.h>
 #include <linux/futex.h>
 
+//------------------------------------------------------------------------------
+// The waiters are split into two groups, like in glibc. New waiters join G2 by
+// bumping the waiter sequence, whose lower half holds the generation of G2.
+// The signals only ever go to G1, which is made of the waiters that were
+// already blocked when the groups were last switched, so a thread that starts
+// waiting after a signal cannot consume it. When G1 has received one signal
+// per waiter, the next signal closes G2 and turns it into G1.
+//
+// The two groups alternate between two slots. Each slot has a word holding
+// the generation of the group using it in the upper half and the number of
+// signals that its waiters may still consume in the lower half, and a futex
+// word that changes whenever the slot gets a signal. A waiter that finds a
+// newer generation in its slot knows that every waiter of its group has been
+// signaled, so it does not need to wait for the stragglers of the previous
+// group to leave before the slot is reused. The generations are compared
+// with the wrap-around in mind, a waiter would have to sleep through 2^31
+// group switches to get confused.
+//
+// The waiters do not take the internal lock; it only serializes the signals
+// and broadcasts, and only when someone waits.
+//------------------------------------------------------------------------------
+#define WSEQ_WAITER (1ULL << 32)
+
+static uint32_t slot_gen(uint64_t signals)
+{
+  return signals >> 32;
+}
+
+static int g1_slot(tbthread_cond_t *cond)
+{
+  return ((uint32_t)__atomic_load_n(&cond->wseq, __ATOMIC_RELAXED) - 1) & 1;
+}
+
+//------------------------------------------------------------------------------
+// Init attributes
+//------------------------------------------------------------------------------
+int tbthread_condattr_init(tbthread_condattr_t *attr)
+{
+  memset(attr, 0, sizeof(tbthread_condattr_t));
+  attr->wake_order = TBTHREAD_WAKE_DEFAULT;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy attributes - no op
+//------------------------------------------------------------------------------
+int tbthread_condattr_destroy(tbthread_condattr_t *attr)
+{
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Set the wake up order
+//------------------------------------------------------------------------------
+int tbthread_condattr_setwakeorder(tbthread_condattr_t *attr, int order)
+{
+  if(order != TBTHREAD_WAKE_DEFAULT && order != TBTHREAD_WAKE_PRIORITY)
+    return -EINVAL;
+  attr->wake_order = order;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Initialize the condvar
+//------------------------------------------------------------------------------
+int tbthread_cond_init(tbthread_cond_t *cond, const tbthread_condattr_t *attr)
+{
+  memset(cond, 0, sizeof(tbthread_cond_t));
+  cond->wake_order = TBTHREAD_WAKE_DEFAULT;
+  if(attr)
+    cond->wake_order = attr->wake_order;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy the condvar
+//------------------------------------------------------------------------------
+int tbthread_cond_destroy(tbthread_cond_t *cond)
+{
+  if(cond->waiters)
+    return -EBUSY;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Check whether we can move the waiters to the mutex futex. The waiters of a
+// priority inheriting mutex need to go through the locking code to boost the
+// owner, and the kernel would not keep the priority order we promised.
+//------------------------------------------------------------------------------
+static int can_requeue(tbthread_cond_t *cond, tbthread_mutex_t *mutex)
+{
+  return mutex && cond->wake_order == TBTHREAD_WAKE_DEFAULT &&
+    mutex->protocol != TBTHREAD_PRIO_INHERIT;
+}
+
+//------------------------------------------------------------------------------
+// Close G2 and make it the new G1; needs the internal lock. Returns the slot
+// of the new G1 or -1 if there is nobody to signal.
+//------------------------------------------------------------------------------
+static int switch_groups(tbthread_cond_t *cond)
+{
+  uint64_t wseq = __atomic_load_n(&cond->wseq, __ATOMIC_ACQUIRE);
+  if((uint32_t)(wseq >> 32) == cond->g1_start)
+    return -1;
+
+  wseq = __sync_fetch_and_add(&cond->wseq, 1);
+  uint32_t gen = wseq;
+  int slot = gen & 1;
+  cond->g1_left = (uint32_t)(wseq >> 32) - cond->g1_start;
+  cond->g1_start = wseq >> 32;
+  __atomic_store_n(&cond->signals[slot], (uint64_t)gen << 32,
+                   __ATOMIC_RELEASE);
+  return slot;
+}
+
+//------------------------------------------------------------------------------
+// Hand out num signals to a slot, return the new value of its futex word
+//------------------------------------------------------------------------------
+static int post_signals(tbthread_cond_t *cond, int slot, uint32_t num)
+{
+  __sync_fetch_and_add(&cond->signals[slot], num);
+  return __sync_add_and_fetch(&cond->wake_seq[slot], 1);
+}
+
+//------------------------------------------------------------------------------
+// Wake the waiters of a slot, the first num of them directly and the rest
+// through the mutex if we can
+//------------------------------------------------------------------------------
+static void wake_slot(tbthread_cond_t *cond, tbthread_mutex_t *mutex, int slot,
+  int seq, int wake, int requeue)
+{
+  int *futex = &cond->wake_seq[slot];
+  if(cond->wake_order == TBTHREAD_WAKE_PRIORITY) {
+    tb_waitq_wake(futex, wake+requeue);
+    return;
+  }
+
+  long st = -EINVAL;
+  if(requeue && can_requeue(cond, mutex))
+    st = SYSCALL6(__NR_futex, futex, FUTEX_CMP_REQUEUE, wake, requeue,
+                  &mutex->futex, seq);
+  if(st < 0)
+    SYSCALL3(__NR_futex, futex, FUTEX_WAKE, wake+requeue);
+}
+
 //------------------------------------------------------------------------------
 // Broadcast
 //------------------------------------------------------------------------------
 int tbthread_cond_broadcast(tbthread_cond_t *cond)
 {
+  if(!__atomic_load_n(&cond->waiters, __ATOMIC_ACQUIRE))
+    return 0;
+
+  //----------------------------------------------------------------------------
+  // Give the remaining G1 waiters their signals, then switch the groups and do
+  // the same for the waiters that were in G2
+  //----------------------------------------------------------------------------
+  int seq[2];
+  int signaled[2] = {0, 0};
   tb_futex_lock(&cond->lock);
-  if(!cond->waiters)
-    goto exit;
-  ++cond->futex;
-  ++cond->broadcast_seq;
-  SYSCALL3(__NR_futex, &cond->futex, FUTEX_WAKE, INT_MAX);
-exit:
+  if(cond->g1_left) {
+    int slot = g1_slot(cond);
+    seq[slot] = post_signals(cond, slot, cond->g1_left);
+    signaled[slot] = 1;
+    cond->g1_left = 0;
+  }
+  int slot = switch_groups(cond);
+  if(slot >= 0) {
+    seq[slot] = post_signals(cond, slot, cond->g1_left);
+    signaled[slot] = 1;
+    cond->g1_left = 0;
+  }
+  tbthread_mutex_t *mutex = cond->mutex;
   tb_futex_unlock(&cond->lock);
+
+  //----------------------------------------------------------------------------
+  // Wake one waiter and move the rest to the futex of the mutex. They will be
+  // woken one by one as the mutex gets unlocked instead of all of them waking
+  // up just to go back to sleep waiting for the mutex. If the slot has moved
+  // in the meantime, or we don't know the mutex, wake everyone.
+  //----------------------------------------------------------------------------
+  for(int i = 0; i < 2; ++i)
+    if(signaled[i])
+      wake_slot(cond, mutex, i, seq[i], 1, INT_MAX);
   return 0;
 }
 
@@ -44,70 +216,90 @@ exit:
 //------------------------------------------------------------------------------
 int tbthread_cond_signal(tbthread_cond_t *cond)
 {
+  if(!__atomic_load_n(&cond->waiters, __ATOMIC_ACQUIRE))
+    return 0;
+
   tb_futex_lock(&cond->lock);
-  if(cond->waiters == cond->signal_num)
-    goto exit;
-  ++cond->futex;
-  ++cond->signal_num;
-  SYSCALL3(__NR_futex, &cond->futex, FUTEX_WAKE, 1);
-exit:
+  int slot = g1_slot(cond);
+  if(!cond->g1_left)
+    slot = switch_groups(cond);
+  if(slot < 0) {
+    tb_futex_unlock(&cond->lock);
+    return 0;
+  }
+  int seq = post_signals(cond, slot, 1);
+  --cond->g1_left;
+  tbthread_mutex_t *mutex = cond->mutex;
   tb_futex_unlock(&cond->lock);
+
+  //----------------------------------------------------------------------------
+  // If we hold the mutex, waking the waiter now would only make it block on
+  // the mutex right away. Move it to the mutex futex instead, so that it is
+  // woken by our unlock.
+  //----------------------------------------------------------------------------
+  if(mutex && mutex->owner == tb_self())
+    wake_slot(cond, mutex, slot, seq, 0, 1);
+  else
+    wake_slot(cond, mutex, slot, seq, 1, 0);
   return 0;
 }
 
+//------------------------------------------------------------------------------
+// Consume a signal of our group; returns 1 if we may leave and 0 if we need to
+// wait for the slot futex to move past seq
+//------------------------------------------------------------------------------
+static int consume_signal(tbthread_cond_t *cond, uint32_t gen, int *seq)
+{
+  int slot = gen & 1;
+  while(1) {
+    *seq = __atomic_load_n(&cond->wake_seq[slot], __ATOMIC_ACQUIRE);
+    uint64_t signals = __atomic_load_n(&cond->signals[slot], __ATOMIC_ACQUIRE);
+    if((int32_t)(slot_gen(signals) - gen) > 0)
+      return 1;
+    if(slot_gen(signals) != gen || !(uint32_t)signals)
+      return 0;
+    if(__sync_bool_compare_and_swap(&cond->signals[slot], signals, signals-1))
+      return 1;
+  }
+}
+
 //------------------------------------------------------------------------------
 // Wait
 //------------------------------------------------------------------------------
 int tbthread_cond_wait(tbthread_cond_t *cond, tbthread_mutex_t *mutex)
 {
-  tb_futex_lock(&cond->lock);
-  int st = 0;
+  if(mutex->owner != tb_self())
+    return -EPERM;
 
-  if(!cond->mutex)
-    cond->mutex = mutex;
+  if(!__sync_bool_compare_and_swap(&cond->mutex, 0, mutex) &&
+     cond->mutex != mutex)
+    return -EINVAL;
 
-  if(cond->mutex != mutex) {
-    st = -EINVAL;
-    goto error;
-  }
-
-  st = tbthread_mutex_unlock(mutex);
-  if(st) goto error;
-
-  ++cond->waiters;
-  int bseq = cond->broadcast_seq;
-  int futex = cond->futex;
-  tb_futex_unlock(&cond->lock);
+  __sync_fetch_and_add(&cond->waiters, 1);
+  uint32_t gen = __sync_fetch_and_add(&cond->wseq, WSEQ_WAITER);
+  int *futex = &cond->wake_seq[gen & 1];
+  tbthread_mutex_unlock(mutex);
 
-  while(1) {
-    st = SYSCALL3(__NR_futex, &cond->futex, FUTEX_WAIT, futex);
-    if(st == -EINTR)
-      continue;
-
-    tb_futex_lock(&cond->lock);
-    if(cond->signal_num) {
-      --cond->signal_num;
-      goto exit;
-    }
-
-    if(bseq != cond->broadcast_seq)
-      goto exit;
-    tb_futex_unlock(&cond->lock);
+  //----------------------------------------------------------------------------
+  // A signal may have moved us to the mutex futex, in which case we have
+  // consumed a wake-up of the mutex. If it turns out that another waiter of
+  // our group has taken the signal, we pass that wake-up on before going back
+  // to sleep, so that a thread waiting for the mutex does not miss it.
+  //----------------------------------------------------------------------------
+  int seq;
+  int woken = 0;
+  while(!consume_signal(cond, gen, &seq)) {
+    if(woken && can_requeue(cond, mutex))
+      SYSCALL3(__NR_futex, &mutex->futex, FUTEX_WAKE, 1);
+    if(cond->wake_order == TBTHREAD_WAKE_PRIORITY)
+      woken = tb_waitq_wait(futex, seq) == 0;
+    else
+      woken = SYSCALL3(__NR_futex, futex, FUTEX_WAIT, seq) == 0;
   }
 
-error:
-  if(!cond->waiters)
-    cond->mutex = 0;
+  if(!__sync_sub_and_fetch(&cond->waiters, 1))
+    __sync_bool_compare_and_swap(&cond->mutex, mutex, 0);
 
-  tb_futex_unlock(&cond->lock);
-  return st;
-
-exit:
-  --cond->waiters;
-  if(!cond->waiters)
-    cond->mutex = 0;
-
-  tb_futex_unlock(&cond->lock);
   tbthread_mutex_lock(mutex);
-  return st;
+  return 0;
 }
@@ -0,0 +1,248 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+//------------------------------------------------------------------------------
+// Hazard pointers. Every thread has a few slots in its descriptor where it
+// publishes the pointers it is about to dereference. Retired objects go to
+// a per-thread list; once the list gets long enough, we collect all the
+// published pointers and free whatever is not among them. The threshold
+// grows with the number of threads, so that every scan frees a good share of
+// the list, while the number of objects waiting to be freed stays bounded
+// no matter how long any thread stalls. The readers only use compiler
+// barriers; the scanner makes them visible with a heavy barrier.
+//------------------------------------------------------------------------------
+#define HAZARD_THRESHOLD_MIN 64
+
+struct retired {
+  void            *ptr;
+  void           (*func)(void *);
+  struct retired  *next;
+};
+
+static struct retired *orphans = 0;
+static int orphans_lock = 0;
+
+//------------------------------------------------------------------------------
+// Publish a pointer loaded from src, make sure that it is still there after
+// it has been published
+//------------------------------------------------------------------------------
+void *tb_hazard_protect(int slot, void **src)
+{
+  struct tbthread *self = tb_self();
+  void *ptr = __atomic_load_n(src, __ATOMIC_ACQUIRE);
+  while(1) {
+    __atomic_store_n(&self->hazards[slot], ptr, __ATOMIC_RELAXED);
+    tb_light_barrier();
+    void *check = __atomic_load_n(src, __ATOMIC_ACQUIRE);
+    if(check == ptr)
+      return ptr;
+    ptr = check;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Publish or clear a pointer that is known to be safe
+//------------------------------------------------------------------------------
+void tb_hazard_set(int slot, void *ptr)
+{
+  __atomic_store_n(&tb_self()->hazards[slot], ptr, __ATOMIC_RELEASE);
+}
+
+void tb_hazard_clear(int slot)
+{
+  __atomic_store_n(&tb_self()->hazards[slot], 0, __ATOMIC_RELEASE);
+}
+
+//------------------------------------------------------------------------------
+// Heap sort the published pointers; we have no libc to provide a qsort
+//------------------------------------------------------------------------------
+static void sift_down(void **hazards, int pos, int num)
+{
+  void *ptr = hazards[pos];
+  while(1) {
+    int child = 2*pos+1;
+    if(child >= num)
+      break;
+    if(child+1 < num && hazards[child+1] > hazards[child])
+      ++child;
+    if(hazards[child] <= ptr)
+      break;
+    hazards[pos] = hazards[child];
+    pos = child;
+  }
+  hazards[pos] = ptr;
+}
+
+static void sort_hazards(void **hazards, int num)
+{
+  for(int i = num/2 - 1; i >= 0; --i)
+    sift_down(hazards, i, num);
+  for(int i = num - 1; i > 0; --i) {
+    void *top = hazards[0];
+    hazards[0] = hazards[i];
+    hazards[i] = top;
+    sift_down(hazards, 0, i);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Look for a pointer among the sorted published ones
+//------------------------------------------------------------------------------
+static int find_hazard(void **hazards, int num, void *ptr)
+{
+  int low = 0;
+  int high = num - 1;
+  while(low <= high) {
+    int mid = (low + high) / 2;
+    if(hazards[mid] == ptr)
+      return 1;
+    if(hazards[mid] < ptr)
+      low = mid + 1;
+    else
+      high = mid - 1;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Free the retired objects that are not published by anyone
+//------------------------------------------------------------------------------
+void tb_hazard_scan()
+{
+  struct tbthread *self = tb_self();
+
+  //----------------------------------------------------------------------------
+  // Adopt the objects left behind by the threads that have exited
+  //----------------------------------------------------------------------------
+  if(orphans) {
+    tb_futex_lock(&orphans_lock);
+    struct retired *list = orphans;
+    orphans = 0;
+    tb_futex_unlock(&orphans_lock);
+    while(list) {
+      struct retired *next = list->next;
+      list->next = self->hazard_retired;
+      self->hazard_retired = list;
+      ++self->hazard_num_retired;
+      list = next;
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Collect the published pointers and sort them. If we cannot get the memory
+  // for them, we leave everything for the next scan.
+  //----------------------------------------------------------------------------
+  tb_heavy_barrier();
+  uint32_t num_slots = tb_desc_num_slots();
+  void **hazards = malloc(num_slots * TBTHREAD_HAZARD_SLOTS * sizeof(void*));
+  if(!hazards)
+    return;
+  int num_threads = 0;
+  int num = 0;
+  tb_desc_walk_begin();
+  for(uint32_t slot = 0; slot < num_slots; ++slot) {
+    struct tbthread *thread = tb_desc_get(slot);
+    if(!thread)
+      continue;
+    ++num_threads;
+    for(int i = 0; i < TBTHREAD_HAZARD_SLOTS; ++i) {
+      void *ptr = __atomic_load_n(&thread->hazards[i], __ATOMIC_ACQUIRE);
+      if(ptr)
+        hazards[num++] = ptr;
+    }
+  }
+  tb_desc_walk_end();
+  sort_hazards(hazards, num);
+
+  //----------------------------------------------------------------------------
+  // Free what we can
+  //----------------------------------------------------------------------------
+  struct retired **cursor = (struct retired **)&self->hazard_retired;
+  while(*cursor) {
+    struct retired *r = *cursor;
+    if(find_hazard(hazards, num, r->ptr)) {
+      cursor = &r->next;
+      continue;
+    }
+    *cursor = r->next;
+    --self->hazard_num_retired;
+    r->func(r->ptr);
+    free(r);
+  }
+  free(hazards);
+
+  self->hazard_threshold = 2 * num_threads * TBTHREAD_HAZARD_SLOTS;
+  if(self->hazard_threshold < HAZARD_THRESHOLD_MIN)
+    self->hazard_threshold = HAZARD_THRESHOLD_MIN;
+}
+
+//------------------------------------------------------------------------------
+// Retire an object, func will be called to free it when nobody uses it
+//------------------------------------------------------------------------------
+int tb_hazard_retire(void *ptr, void (*func)(void *))
+{
+  struct tbthread *self = tb_self();
+  struct retired *r = malloc(sizeof(struct retired));
+  if(!r)
+    return -ENOMEM;
+  r->ptr = ptr;
+  r->func = func;
+  r->next = self->hazard_retired;
+  self->hazard_retired = r;
+  ++self->hazard_num_retired;
+
+  uint32_t threshold = self->hazard_threshold;
+  if(!threshold)
+    threshold = HAZARD_THRESHOLD_MIN;
+  if(self->hazard_num_retired >= threshold)
+    tb_hazard_scan();
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Clean up after an exiting thread; whatever cannot be freed now is handed
+// over to the next thread that scans
+//------------------------------------------------------------------------------
+void tb_hazard_thread_exit()
+{
+  struct tbthread *self = tb_self();
+  for(int i = 0; i < TBTHREAD_HAZARD_SLOTS; ++i)
+    self->hazards[i] = 0;
+
+  if(!self->hazard_retired)
+    return;
+  tb_hazard_scan();
+
+  struct retired *list = self->hazard_retired;
+  if(!list)
+    return;
+  struct retired *last = list;
+  while(last->next)
+    last = last->next;
+
+  tb_futex_lock(&orphans_lock);
+  last->next = orphans;
+  orphans = list;
+  tb_futex_unlock(&orphans_lock);
+  self->hazard_retired = 0;
+  self->hazard_num_retired = 0;
+}
@@ -0,0 +1,206 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+
+//------------------------------------------------------------------------------
+// Latches and wait-groups are one futex word each: the count lives in the low
+// 24 bits, the top bit says that somebody sleeps, and the bits in between
+// hold a generation number that changes every time the count drops to zero
+// while somebody waits. The waiters leave when they see either a zero count or
+// a new generation, so a wait-group that has been reused before a sleeper got
+// a chance to run does not keep it waiting for the next round. Nobody gets
+// woken up before the count reaches zero.
+//------------------------------------------------------------------------------
+#define COUNT_MASK   0x00ffffff
+#define COUNT_GEN    0x01000000
+#define COUNT_GENS   0x7f000000
+#define COUNT_WAITER 0x80000000
+
+//------------------------------------------------------------------------------
+// Add delta to the count and wake the waiters if it drops to zero
+//------------------------------------------------------------------------------
+static int count_add(uint32_t *word, int delta)
+{
+  uint32_t value, new_value;
+  int count;
+  do {
+    value = *word;
+    count = (int)(value & COUNT_MASK) + delta;
+    if(count < 0 || count > COUNT_MASK)
+      return -EINVAL;
+    new_value = (value & ~COUNT_MASK) | count;
+    if(count == 0 && (value & COUNT_WAITER))
+      new_value = (value + COUNT_GEN) & COUNT_GENS;
+  } while(!__sync_bool_compare_and_swap(word, value, new_value));
+
+  if(count == 0 && (value & COUNT_WAITER)) {
+    SYSCALL3(__NR_futex, word, FUTEX_WAKE, INT_MAX);
+    tb_waitany_notify();
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Get the current generation
+//------------------------------------------------------------------------------
+uint32_t tb_count_gen(uint32_t *word)
+{
+  return __atomic_load_n(word, __ATOMIC_ACQUIRE) & COUNT_GENS;
+}
+
+//------------------------------------------------------------------------------
+// Check if the count dropped to zero since the generation gen; if not, mark
+// the word as waited on and tell the caller what value to sleep on
+//------------------------------------------------------------------------------
+int tb_count_arm(uint32_t *word, uint32_t gen, uint32_t *expected)
+{
+  uint32_t value = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+  while((value & COUNT_MASK) && (value & COUNT_GENS) == gen) {
+    if(value & COUNT_WAITER) {
+      *expected = value;
+      return 0;
+    }
+    if(__sync_bool_compare_and_swap(word, value, value | COUNT_WAITER)) {
+      *expected = value | COUNT_WAITER;
+      return 0;
+    }
+    value = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+  }
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+// Wait for the count to drop to zero
+//------------------------------------------------------------------------------
+static int count_wait(uint32_t *word)
+{
+  uint32_t gen = tb_count_gen(word);
+  uint32_t value;
+  while(!tb_count_arm(word, gen, &value))
+    SYSCALL3(__NR_futex, word, FUTEX_WAIT, value);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Initialize the latch
+//------------------------------------------------------------------------------
+int tbthread_latch_init(tbthread_latch_t *latch, unsigned count)
+{
+  if(count > TBTHREAD_LATCH_COUNT_MAX)
+    return -EINVAL;
+  latch->value = count;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy the latch
+//------------------------------------------------------------------------------
+int tbthread_latch_destroy(tbthread_latch_t *latch)
+{
+  if(latch->value & COUNT_WAITER)
+    return -EBUSY;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Count down by n
+//------------------------------------------------------------------------------
+int tbthread_latch_count_down_n(tbthread_latch_t *latch, unsigned n)
+{
+  if(n > TBTHREAD_LATCH_COUNT_MAX)
+    return -EINVAL;
+  return count_add(&latch->value, -(int)n);
+}
+
+//------------------------------------------------------------------------------
+// Count down by one
+//------------------------------------------------------------------------------
+int tbthread_latch_count_down(tbthread_latch_t *latch)
+{
+  return count_add(&latch->value, -1);
+}
+
+//------------------------------------------------------------------------------
+// Wait for the latch to open
+//------------------------------------------------------------------------------
+int tbthread_latch_wait(tbthread_latch_t *latch)
+{
+  return count_wait(&latch->value);
+}
+
+//------------------------------------------------------------------------------
+// Check if the latch is open
+//------------------------------------------------------------------------------
+int tbthread_latch_trywait(tbthread_latch_t *latch)
+{
+  if(__atomic_load_n(&latch->value, __ATOMIC_ACQUIRE) & COUNT_MASK)
+    return -EAGAIN;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Initialize the wait-group
+//------------------------------------------------------------------------------
+int tbthread_waitgroup_init(tbthread_waitgroup_t *wg)
+{
+  wg->value = 0;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy the wait-group
+//------------------------------------------------------------------------------
+int tbthread_waitgroup_destroy(tbthread_waitgroup_t *wg)
+{
+  if(wg->value & COUNT_WAITER)
+    return -EBUSY;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Add delta tasks, delta may be negative
+//------------------------------------------------------------------------------
+int tbthread_waitgroup_add(tbthread_waitgroup_t *wg, int delta)
+{
+  if(delta > TBTHREAD_WAITGROUP_COUNT_MAX ||
+     delta < -TBTHREAD_WAITGROUP_COUNT_MAX)
+    return -EINVAL;
+  return count_add(&wg->value, delta);
+}
+
+//------------------------------------------------------------------------------
+// Mark one task as done
+//------------------------------------------------------------------------------
+int tbthread_waitgroup_done(tbthread_waitgroup_t *wg)
+{
+  return count_add(&wg->value, -1);
+}
+
+//------------------------------------------------------------------------------
+// Wait for all the tasks to be done
+//------------------------------------------------------------------------------
+int tbthread_waitgroup_wait(tbthread_waitgroup_t *wg)
+{
+  return count_wait(&wg->value);
+}
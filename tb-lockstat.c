@@ -0,0 +1,228 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+#include <string.h>
+
+//------------------------------------------------------------------------------
+// The statistics table. We cannot allocate memory here because malloc takes
+// a lock that we instrument, so everything lives in a static open-addressing
+// hash table keyed by the address of the lock. All the updates are done with
+// atomics, because the table is shared by all the threads.
+//------------------------------------------------------------------------------
+#define LOCKSTAT_SIZE  1024
+#define LOCKSTAT_SITES 4
+
+struct lockstat_site {
+  uint64_t  wait;
+  void     *site;
+};
+
+struct lockstat {
+  const void           *lock;
+  const char           *name;
+  uint64_t              acquired;
+  uint64_t              contended;
+  uint64_t              wait_total;
+  uint64_t              wait_max;
+  uint64_t              hold_total;
+  uint64_t              hold_max;
+  uint64_t              hold_start;
+  int                   sites_lock;
+  struct lockstat_site  sites[LOCKSTAT_SITES];
+};
+
+static struct lockstat stats[LOCKSTAT_SIZE];
+static uint64_t overflow;
+int tb_lockstat_enabled = 0;
+
+//------------------------------------------------------------------------------
+// Time stamp in CPU cycles
+//------------------------------------------------------------------------------
+uint64_t tb_lockstat_clock()
+{
+  return __builtin_ia32_rdtsc();
+}
+
+//------------------------------------------------------------------------------
+// Find the stats entry for the lock or make a new one
+//------------------------------------------------------------------------------
+static struct lockstat *find_entry(const void *lock)
+{
+  uint64_t hash = ((uint64_t)lock >> 2) * 0x9e3779b97f4a7c15ULL;
+  uint32_t index = hash >> 54;
+  for(int i = 0; i < LOCKSTAT_SIZE; ++i) {
+    struct lockstat *st = &stats[(index + i) & (LOCKSTAT_SIZE - 1)];
+    const void *key = st->lock;
+    if(key == lock)
+      return st;
+    if(key)
+      continue;
+    if(__sync_bool_compare_and_swap(&st->lock, 0, lock) || st->lock == lock)
+      return st;
+  }
+  __sync_fetch_and_add(&overflow, 1);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Update the maximum
+//------------------------------------------------------------------------------
+static void update_max(uint64_t *max, uint64_t value)
+{
+  uint64_t current;
+  while((current = *max) < value)
+    if(__sync_bool_compare_and_swap(max, current, value))
+      break;
+}
+
+//------------------------------------------------------------------------------
+// Remember the call site if the wait is among the slowest ones
+//------------------------------------------------------------------------------
+static void record_site(struct lockstat *st, uint64_t wait, void *site)
+{
+  if(wait <= st->sites[LOCKSTAT_SITES-1].wait)
+    return;
+
+  while(!__sync_bool_compare_and_swap(&st->sites_lock, 0, 1))
+    asm volatile("pause" ::: "memory");
+
+  int i = LOCKSTAT_SITES-1;
+  if(wait > st->sites[i].wait) {
+    for(; i > 0 && st->sites[i-1].wait < wait; --i)
+      st->sites[i] = st->sites[i-1];
+    st->sites[i].wait = wait;
+    st->sites[i].site = site;
+  }
+
+  __sync_lock_release(&st->sites_lock);
+}
+
+//------------------------------------------------------------------------------
+// Record an acquisition
+//------------------------------------------------------------------------------
+void tb_lockstat_acquired(const void *lock, uint64_t start, int contended,
+  void *site)
+{
+  struct lockstat *st = find_entry(lock);
+  if(!st)
+    return;
+
+  uint64_t now = tb_lockstat_clock();
+  uint64_t wait = now - start;
+  __sync_fetch_and_add(&st->acquired, 1);
+  st->hold_start = now;
+  if(!contended)
+    return;
+
+  __sync_fetch_and_add(&st->contended, 1);
+  __sync_fetch_and_add(&st->wait_total, wait);
+  update_max(&st->wait_max, wait);
+  record_site(st, wait, site);
+}
+
+//------------------------------------------------------------------------------
+// Record a release; this needs to be called while the lock is still held
+//------------------------------------------------------------------------------
+void tb_lockstat_released(const void *lock)
+{
+  struct lockstat *st = find_entry(lock);
+  if(!st || !st->hold_start)
+    return;
+
+  uint64_t hold = tb_lockstat_clock() - st->hold_start;
+  st->hold_start = 0;
+  __sync_fetch_and_add(&st->hold_total, hold);
+  update_max(&st->hold_max, hold);
+}
+
+//------------------------------------------------------------------------------
+// Enable or disable the statistics
+//------------------------------------------------------------------------------
+void tb_lockstat_enable(int enable)
+{
+  tb_lockstat_enabled = enable;
+}
+
+//------------------------------------------------------------------------------
+// Give the lock a human readable name
+//------------------------------------------------------------------------------
+void tb_lockstat_name(const void *lock, const char *name)
+{
+  struct lockstat *st = find_entry(lock);
+  if(st)
+    st->name = name;
+}
+
+//------------------------------------------------------------------------------
+// Clear the counters, keep the names
+//------------------------------------------------------------------------------
+void tb_lockstat_reset()
+{
+  for(int i = 0; i < LOCKSTAT_SIZE; ++i) {
+    struct lockstat *st = &stats[i];
+    st->acquired   = 0;
+    st->contended  = 0;
+    st->wait_total = 0;
+    st->wait_max   = 0;
+    st->hold_total = 0;
+    st->hold_max   = 0;
+    st->hold_start = 0;
+    memset(st->sites, 0, sizeof(st->sites));
+  }
+  overflow = 0;
+}
+
+//------------------------------------------------------------------------------
+// Print the statistics sorted by the total wait time
+//------------------------------------------------------------------------------
+void tb_lockstat_dump()
+{
+  uint16_t order[LOCKSTAT_SIZE];
+  int num = 0;
+
+  for(int i = 0; i < LOCKSTAT_SIZE; ++i) {
+    if(!stats[i].acquired)
+      continue;
+    int j = num++;
+    for(; j > 0 && stats[order[j-1]].wait_total < stats[i].wait_total; --j)
+      order[j] = order[j-1];
+    order[j] = i;
+  }
+
+  tbprint("Lock statistics (times in CPU cycles), %d locks", num);
+  if(overflow)
+    tbprint(", %llu acquisitions not recorded", overflow);
+  tbprint("\n");
+
+  for(int i = 0; i < num; ++i) {
+    struct lockstat *st = &stats[order[i]];
+    tbprint("0x%llx (%s): acquired: %llu, contended: %llu, "
+            "wait total: %llu, wait max: %llu, hold total: %llu, "
+            "hold max: %llu\n",
+            st->lock, st->name ? st->name : "unnamed", st->acquired,
+            st->contended, st->wait_total, st->wait_max, st->hold_total,
+            st->hold_max);
+    for(int j = 0; j < LOCKSTAT_SITES && st->sites[j].site; ++j)
+      tbprint("    slow acquisition at 0x%llx: %llu\n", st->sites[j].site,
+              st->sites[j].wait);
+  }
+}
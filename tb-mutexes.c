@@ -83,7 +83,7 @@ static int (*unlockers[])(tbthread_mutex_t *) = {
 //------------------------------------------------------------------------------
 // Low level locking
 //------------------------------------------------------------------------------
-void tb_futex_lock(int *futex)
+static void futex_lock(int *futex)
 {
   while(1) {
     if(__sync_bool_compare_and_swap(futex, 0, 1))
@@ -92,19 +92,51 @@ void tb_futex_lock(int *futex)
   }
 }
 
-int tb_futex_trylock(int *futex)
+static int futex_trylock(int *futex)
 {
   if(__sync_bool_compare_and_swap(futex, 0, 1))
       return 0;
   return -EBUSY;
 }
 
-void tb_futex_unlock(int *futex)
+static void futex_unlock(int *futex)
 {
   if(__sync_bool_compare_and_swap(futex, 1, 0))
     SYSCALL3(__NR_futex, futex, FUTEX_WAKE, 1);
 }
 
+//------------------------------------------------------------------------------
+// Low level locking with statistics
+//------------------------------------------------------------------------------
+void tb_futex_lock(int *futex)
+{
+  if(__builtin_expect(tb_lockstat_enabled, 0)) {
+    uint64_t start = tb_lockstat_clock();
+    int contended = futex_trylock(futex);
+    if(contended)
+      futex_lock(futex);
+    tb_lockstat_acquired(futex, start, contended, __builtin_return_address(0));
+    return;
+  }
+  futex_lock(futex);
+}
+
+int tb_futex_trylock(int *futex)
+{
+  int ret = futex_trylock(futex);
+  if(__builtin_expect(tb_lockstat_enabled, 0) && ret == 0)
+    tb_lockstat_acquired(futex, tb_lockstat_clock(), 0,
+                         __builtin_return_address(0));
+  return ret;
+}
+
+void tb_futex_unlock(int *futex)
+{
+  if(__builtin_expect(tb_lockstat_enabled, 0))
+    tb_lockstat_released(futex);
+  futex_unlock(futex);
+}
+
 //------------------------------------------------------------------------------
 // Normal mutex
 //------------------------------------------------------------------------------
@@ -128,11 +160,10 @@ static int unlock_normal(tbthread_mutex_t *mutex)
 //------------------------------------------------------------------------------
 static int lock_errorcheck(tbthread_mutex_t *mutex)
 {
-  tbthread_t self = tbthread_self();
+  struct tbthread *self = tb_self();
   if(mutex->owner == self)
     return -EDEADLK;
-  (*lockers[mutex->protocol])(mutex);
-  return 0;
+  return (*lockers[mutex->protocol])(mutex);
 }
 
 static int trylock_errorcheck(tbthread_mutex_t *mutex)
@@ -142,7 +173,7 @@ static int trylock_errorcheck(tbthread_mutex_t *mutex)
 
 static int unlock_errorcheck(tbthread_mutex_t *mutex)
 {
-  if(mutex->owner != tbthread_self() || mutex->futex == 0)
+  if(mutex->owner != tb_self() || mutex->futex == 0)
     return -EPERM;
   (*unlockers[mutex->protocol])(mutex);
   return 0;
@@ -153,9 +184,11 @@ static int unlock_errorcheck(tbthread_mutex_t *mutex)
 //------------------------------------------------------------------------------
 static int lock_recursive(tbthread_mutex_t *mutex)
 {
-  tbthread_t self = tbthread_self();
+  struct tbthread *self = tb_self();
   if(mutex->owner != self) {
-    (*lockers[mutex->protocol])(mutex);
+    int ret = (*lockers[mutex->protocol])(mutex);
+    if(ret)
+      return ret;
     mutex->owner   = self;
   }
   if(mutex->counter == (uint64_t)-1)
@@ -166,11 +199,11 @@ static int lock_recursive(tbthread_mutex_t *mutex)
 
 static int trylock_recursive(tbthread_mutex_t *mutex)
 {
-  tbthread_t self = tbthread_self();
-  if(mutex->owner != self && (*trylockers[mutex->protocol])(mutex))
-    return -EBUSY;
-
+  struct tbthread *self = tb_self();
   if(mutex->owner != self) {
+    int ret = (*trylockers[mutex->protocol])(mutex);
+    if(ret)
+      return ret;
     mutex->owner = self;
     mutex->counter = 1;
     return 0;
@@ -185,7 +218,7 @@ static int trylock_recursive(tbthread_mutex_t *mutex)
 
 static int unlock_recursive(tbthread_mutex_t *mutex)
 {
-  if(mutex->owner != tbthread_self())
+  if(mutex->owner != tb_self())
     return -EPERM;
   --mutex->counter;
   if(mutex->counter == 0) {
@@ -200,67 +233,89 @@ static int unlock_recursive(tbthread_mutex_t *mutex)
 //------------------------------------------------------------------------------
 static int lock_prio_none(tbthread_mutex_t *mutex)
 {
-  tb_futex_lock(&mutex->futex);
-  mutex->owner = tbthread_self();
+  futex_lock(&mutex->futex);
+  mutex->owner = tb_self();
   return 0;
 }
 
 static int trylock_prio_none(tbthread_mutex_t *mutex)
 {
-  int ret = tb_futex_trylock(&mutex->futex);
+  int ret = futex_trylock(&mutex->futex);
   if(ret == 0)
-      mutex->owner = tbthread_self();
+      mutex->owner = tb_self();
   return ret;
 }
 
 static int unlock_prio_none(tbthread_mutex_t *mutex)
 {
   mutex->owner = 0;
-  tb_futex_unlock(&mutex->futex);
+  futex_unlock(&mutex->futex);
   return 0;
 }
 
 //------------------------------------------------------------------------------
 // Priority inherit
 //------------------------------------------------------------------------------
+static void set_blocked_on(struct tbthread *thread, tbthread_mutex_t *mutex)
+{
+  tb_futex_lock(&thread->lock);
+  thread->blocked_on = mutex;
+  tb_futex_unlock(&thread->lock);
+}
+
 static int lock_prio_inherit(tbthread_mutex_t *mutex)
 {
-  tbthread_t self = tbthread_self();
+  struct tbthread *self = tb_self();
 
   while(1) {
     int locked = 0;
+    struct tbthread *boosted = 0;
     tb_futex_lock(&mutex->internal_futex);
     if(mutex->futex == 0) {
       locked = 1;
       mutex->owner = self;
-      mutex->futex = 1;
-      tb_inherit_mutex_add(mutex);
+      if(tb_inherit_mutex_add(mutex)) {
+        mutex->owner = 0;
+        locked = -EAGAIN;
+      }
+      else
+        mutex->futex = 1;
+      if(self->blocked_on)
+        set_blocked_on(self, 0);
+    }
+    else {
+      set_blocked_on(self, mutex);
+      boosted = tb_inherit_mutex_sched(mutex, self);
+      if(boosted)
+        tb_desc_walk_begin();
     }
-    else
-      tb_inherit_mutex_sched(mutex, self);
     tb_futex_unlock(&mutex->internal_futex);
     if(locked)
-      return 0;
+      return locked < 0 ? locked : 0;
+    if(boosted) {
+      tb_inherit_chain_sched(boosted, self);
+      tb_desc_walk_end();
+    }
     SYSCALL3(__NR_futex, &mutex->futex, FUTEX_WAIT, 1);
   }
 }
 
 static int trylock_prio_inherit(tbthread_mutex_t *mutex)
 {
-  tbthread_t self = tbthread_self();
+  struct tbthread *self = tb_self();
 
-  int locked = 0;
+  int ret = -EBUSY;
   tb_futex_lock(&mutex->internal_futex);
   if(mutex->futex == 0) {
-    locked = 1;
     mutex->owner = self;
-    mutex->futex = 1;
-    tb_inherit_mutex_add(mutex);
+    ret = tb_inherit_mutex_add(mutex);
+    if(ret)
+      mutex->owner = 0;
+    else
+      mutex->futex = 1;
   }
   tb_futex_unlock(&mutex->internal_futex);
-  if(locked)
-    return 0;
-  return -EBUSY;
+  return ret;
 }
 
 static int unlock_prio_inherit(tbthread_mutex_t *mutex)
@@ -280,21 +335,26 @@ static int unlock_prio_inherit(tbthread_mutex_t *mutex)
 static int lock_prio_protect(tbthread_mutex_t *mutex)
 {
   lock_prio_none(mutex);
-  tb_protect_mutex_sched(mutex);
-  return 0;
+  int ret = tb_protect_mutex_sched(mutex);
+  if(ret)
+    unlock_prio_none(mutex);
+  return ret;
 }
 
 static int trylock_prio_protect(tbthread_mutex_t *mutex)
 {
   int ret = trylock_prio_none(mutex);
-  if(ret == 0)
-    tb_protect_mutex_sched(mutex);
+  if(ret == 0) {
+    ret = tb_protect_mutex_sched(mutex);
+    if(ret)
+      unlock_prio_none(mutex);
+  }
   return ret;
 }
 
 static int unlock_prio_protect(tbthread_mutex_t *mutex)
 {
-  tbthread_t self = tbthread_self();
+  struct tbthread *self = tb_self();
   tb_protect_mutex_unsched(mutex);
   unlock_prio_none(mutex);
   return 0;
@@ -372,6 +432,19 @@ int tbthread_mutex_destroy(tbthread_mutex_t *mutex)
 //------------------------------------------------------------------------------
 int tbthread_mutex_lock(tbthread_mutex_t *mutex)
 {
+  if(__builtin_expect(tb_lockstat_enabled, 0)) {
+    uint64_t start = tb_lockstat_clock();
+    int contended = 0;
+    int ret = (*trylockers[mutex->type])(mutex);
+    if(ret == -EBUSY) {
+      contended = 1;
+      ret = (*lockers[mutex->type])(mutex);
+    }
+    if(ret == 0 && mutex->counter <= 1)
+      tb_lockstat_acquired(mutex, start, contended,
+                           __builtin_return_address(0));
+    return ret;
+  }
   return (*lockers[mutex->type])(mutex);
 }
 
@@ -380,7 +453,12 @@ int tbthread_mutex_lock(tbthread_mutex_t *mutex)
 //------------------------------------------------------------------------------
 int tbthread_mutex_trylock(tbthread_mutex_t *mutex)
 {
-  return (*trylockers[mutex->type])(mutex);
+  int ret = (*trylockers[mutex->type])(mutex);
+  if(__builtin_expect(tb_lockstat_enabled, 0) && ret == 0 &&
+     mutex->counter <= 1)
+    tb_lockstat_acquired(mutex, tb_lockstat_clock(), 0,
+                         __builtin_return_address(0));
+  return ret;
 }
 
 //------------------------------------------------------------------------------
@@ -388,6 +466,9 @@ int tbthread_mutex_trylock(tbthread_mutex_t *mutex)
 //------------------------------------------------------------------------------
 int tbthread_mutex_unlock(tbthread_mutex_t *mutex)
 {
+  if(__builtin_expect(tb_lockstat_enabled, 0) &&
+     mutex->owner == tb_self() && mutex->counter <= 1)
+    tb_lockstat_released(mutex);
   return (*unlockers[mutex->type])(mutex);;
 }
 
@@ -439,7 +520,7 @@ int tbthread_mutex_setprioceiling(tbthread_mutex_t *mutex, int ceiling,
     return -EINVAL;
 
 
-  tbthread_t self = tbthread_self();
+  struct tbthread *self = tb_self();
   int locked = 0;
   if(mutex->owner != self) {
     lock_normal(mutex);
@@ -47,24 +47,143 @@
 #define SCHED_INFO_POLICY(info) (info >> 8)
 #define SCHED_INFO_PRIORITY(info) (info & 0x00ff)
 
+//------------------------------------------------------------------------------
+// Thread specific data; the first block of entries lives in the descriptor,
+// the remaining ones are allocated when a thread first sets a value in them
+//------------------------------------------------------------------------------
+#define TB_TLS_BLOCK_SIZE 32
+#define TB_TLS_BLOCKS     (TBTHREAD_MAX_KEYS / TB_TLS_BLOCK_SIZE)
+
+struct tb_tls_entry
+{
+  uint64_t seq;
+  void *data;
+};
+
+//------------------------------------------------------------------------------
+// Thread descriptor; the handles index a slot table and carry the
+// generation of the slot, so that the stale ones can be told apart. The
+// descriptor is what %fs points to, and the dynamic linker of glibc clears
+// the word at %fs:0x1c when it resolves a symbol lazily, so the head of the
+// structure can only hold the fields that are not needed after the start.
+//
+// The fields are grouped by who writes them. The first group is written by
+// the thread itself and at most read by the others. The second one starts a
+// cache line of its own and holds what other threads write: the cancellation
+// and join state, and everything that priority inheritance updates under the
+// descriptor lock. The rest is cold. Building with TB_PACKED_DESCRIPTOR
+// defined puts the fields written by the other threads back in the middle
+// of the thread's own ones, which is how they used to be laid out, so that
+// bench-02 can compare the two.
+//------------------------------------------------------------------------------
+#ifndef TB_PACKED_DESCRIPTOR
+#define TB_DESC_LINE __attribute__((aligned(64)))
+#else
+#define TB_DESC_LINE
+#endif
+
+struct tbthread
+{
+  struct tbthread *self;
+  void *stack;
+  uint32_t stack_size;
+  uint32_t tid;
+  void *(*fn)(void *);
+  void *arg;
+  void *retval;
+  tbthread_t handle;
+  uint32_t guard_size;
+#ifdef TB_PACKED_DESCRIPTOR
+  uint8_t join_status;
+  uint8_t cancel_status;
+  uint16_t sched_info;
+  uint16_t user_sched_info;
+  uint16_t prio_heap_size;
+  uint32_t start_status;
+  uint32_t lock;
+  struct tbthread *joiner;
+  struct tbthread_mutex *blocked_on;
+#endif
+  uint32_t rcu_nesting;
+  uint64_t rcu_ctr;
+  void *hazards[TBTHREAD_HAZARD_SLOTS];
+  void *hazard_retired;
+  uint32_t hazard_num_retired;
+  uint32_t hazard_threshold;
+  list_t cleanup_handlers;
+
+#ifndef TB_PACKED_DESCRIPTOR
+  uint8_t join_status TB_DESC_LINE;
+  uint8_t cancel_status;
+  uint16_t sched_info;
+  uint16_t user_sched_info;
+  uint16_t prio_heap_size;
+  uint32_t start_status;
+  uint32_t lock;
+  struct tbthread *joiner;
+  struct tbthread_mutex *blocked_on;
+#endif
+
+  struct tbthread_mutex *prio_heap[TBTHREAD_MAX_PRIO_MUTEXES] TB_DESC_LINE;
+  struct tb_tls_entry tls[TB_TLS_BLOCK_SIZE];
+  struct tb_tls_entry *tls_blocks[TB_TLS_BLOCKS-1];
+  uint8_t stack_mode;
+  uint8_t user_stack;
+  struct tbthread *next_exited;
+};
+
+struct tbthread *tb_self();
+struct tbthread *tb_desc_lookup(tbthread_t handle);
+uint32_t tb_desc_num_slots();
+struct tbthread *tb_desc_get(uint32_t index);
+void tb_desc_walk_begin();
+void tb_desc_walk_end();
+
+int tb_stack_get(void **stack, uint32_t size, uint32_t guard, int mode);
+void tb_stack_put(void *stack, uint32_t size, uint32_t guard, int mode);
+
+void tb_barrier_init();
 void tb_tls_call_destructors();
+void tb_tls_free_blocks(struct tbthread *thread);
+void tb_hazard_thread_exit();
 void tb_cancel_handler(int sig, siginfo_t *si, void *ctx);
 void tb_call_cleanup_handlers();
 void tb_clear_cleanup_handlers();
 
-int tb_set_sched(tbthread_t thread, int policy, int priority);
-int tb_compute_sched(tbthread_t thread);
+int tb_set_sched(struct tbthread *thread, int policy, int priority);
+int tb_compute_sched(struct tbthread *thread);
 
-void tb_protect_mutex_sched(tbthread_mutex_t *mutex);
+int tb_protect_mutex_sched(tbthread_mutex_t *mutex);
 void tb_protect_mutex_unsched(tbthread_mutex_t *mutex);
-void tb_inherit_mutex_add(tbthread_mutex_t *mutex);
+int tb_inherit_mutex_add(tbthread_mutex_t *mutex);
 void tb_inherit_mutex_unsched(tbthread_mutex_t *mutex);
-void tb_inherit_mutex_sched(tbthread_mutex_t *mutex, tbthread_t thread);
+struct tbthread *tb_inherit_mutex_sched(tbthread_mutex_t *mutex,
+  struct tbthread *thread);
+void tb_inherit_chain_sched(struct tbthread *thread, struct tbthread *origin);
+
+int tb_park(void *addr, int (*validate)(void *), void *arg);
+int tb_unpark(void *addr, int num, void (*callback)(void *, int, int),
+  void *arg);
+int tb_waitq_wait(int *addr, int val);
+int tb_waitq_wake(int *addr, int num);
+
+void tb_sem_register(tbthread_sem_t *sem);
+void tb_sem_unregister(tbthread_sem_t *sem);
+int tb_sem_arm(tbthread_sem_t *sem, int **futex, uint32_t *expected);
+uint32_t tb_count_gen(uint32_t *word);
+int tb_count_arm(uint32_t *word, uint32_t gen, uint32_t *expected);
+void tb_waitany_notify();
 
 void tb_futex_lock(int *futex);
 int tb_futex_trylock(int *futex);
 void tb_futex_unlock(int *futex);
 
-extern tbthread_mutex_t desc_mutex;
-extern list_t used_desc;
+extern int tb_lockstat_enabled;
+uint64_t tb_lockstat_clock();
+void tb_lockstat_acquired(const void *lock, uint64_t start, int contended,
+  void *site);
+void tb_lockstat_released(const void *lock);
+
+extern int memory_lock;
+extern int print_lock;
 extern int tb_pid;
@@ -0,0 +1,188 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+#include <linux/futex.h>
+
+//------------------------------------------------------------------------------
+// Quiescent state based RCU. Every online thread keeps a snapshot of the grace
+// period counter taken at its last quiescent state; offline threads keep
+// zero. The readers don't do anything but bump their nesting counter. A
+// writer starts a new grace period by bumping the global counter and then
+// waits for every online thread to report a quiescent state, so the whole
+// cost is paid on the update side: the readers only use compiler barriers,
+// and the writer forces the memory barriers on them with a heavy barrier.
+//------------------------------------------------------------------------------
+static uint64_t gp_ctr = 1;
+static int gp_lock = 0;
+
+//------------------------------------------------------------------------------
+// Read-side critical section
+//------------------------------------------------------------------------------
+void tb_rcu_read_lock()
+{
+  ++tb_self()->rcu_nesting;
+  asm volatile("" ::: "memory");
+}
+
+void tb_rcu_read_unlock()
+{
+  asm volatile("" ::: "memory");
+  --tb_self()->rcu_nesting;
+}
+
+//------------------------------------------------------------------------------
+// Report a quiescent state; this must be done outside of any read-side
+// critical section
+//------------------------------------------------------------------------------
+void tb_rcu_quiescent_state()
+{
+  struct tbthread *self = tb_self();
+  if(self->rcu_nesting || !self->rcu_ctr)
+    return;
+  tb_light_barrier();
+  __atomic_store_n(&self->rcu_ctr, __atomic_load_n(&gp_ctr, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  tb_light_barrier();
+}
+
+//------------------------------------------------------------------------------
+// Going offline is an extended quiescent state; a thread needs to be online to
+// enter read-side critical sections
+//------------------------------------------------------------------------------
+void tb_rcu_thread_offline()
+{
+  struct tbthread *self = tb_self();
+  tb_light_barrier();
+  __atomic_store_n(&self->rcu_ctr, 0, __ATOMIC_RELAXED);
+}
+
+void tb_rcu_thread_online()
+{
+  struct tbthread *self = tb_self();
+  __atomic_store_n(&self->rcu_ctr, __atomic_load_n(&gp_ctr, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  tb_light_barrier();
+}
+
+//------------------------------------------------------------------------------
+// Wait for a grace period. We walk the descriptor registry without taking any
+// locks, so that the readers can still create and join threads. The stacks,
+// and the descriptors on top of them, are not unmapped while we walk, only
+// recycled, and a recycled descriptor starts offline, so looking at them
+// while they change hands is safe.
+//------------------------------------------------------------------------------
+void tb_synchronize_rcu()
+{
+  struct tbthread *self = tb_self();
+  int online = self->rcu_ctr != 0;
+  if(online)
+    tb_rcu_thread_offline();
+
+  tb_futex_lock(&gp_lock);
+  tb_heavy_barrier();
+  uint64_t gp = __sync_add_and_fetch(&gp_ctr, 1);
+
+  tb_desc_walk_begin();
+  uint32_t num = tb_desc_num_slots();
+  for(uint32_t i = 0; i < num; ++i) {
+    struct tbthread *thread = tb_desc_get(i);
+    if(!thread)
+      continue;
+    uint64_t ctr;
+    while((ctr = __atomic_load_n(&thread->rcu_ctr, __ATOMIC_RELAXED)) &&
+          ctr != gp)
+      SYSCALL0(__NR_sched_yield);
+  }
+  tb_desc_walk_end();
+  tb_heavy_barrier();
+
+  tb_futex_unlock(&gp_lock);
+
+  if(online)
+    tb_rcu_thread_online();
+}
+
+//------------------------------------------------------------------------------
+// Deferred reclamation. The callbacks are pushed to a lock-free stack and
+// processed in batches by a detached reclaimer thread that is started on the
+// first use. The reclaimer sleeps on cb_futex when it has nothing to do.
+//------------------------------------------------------------------------------
+static struct tb_rcu_head *cb_head = 0;
+static int cb_futex = 0;
+static tbthread_once_t reclaimer_once = TBTHREAD_ONCE_INIT;
+
+static void *reclaimer_func(void *arg)
+{
+  while(1) {
+    __sync_lock_test_and_set(&cb_futex, 1);
+    struct tb_rcu_head *head = __sync_lock_test_and_set(&cb_head, 0);
+    if(!head) {
+      SYSCALL3(__NR_futex, &cb_futex, FUTEX_WAIT, 1);
+      continue;
+    }
+    cb_futex = 0;
+
+    //--------------------------------------------------------------------------
+    // Reverse the stack to run the callbacks in the order they were queued
+    //--------------------------------------------------------------------------
+    struct tb_rcu_head *batch = 0;
+    while(head) {
+      struct tb_rcu_head *next = head->next;
+      head->next = batch;
+      batch = head;
+      head = next;
+    }
+
+    tb_synchronize_rcu();
+    while(batch) {
+      struct tb_rcu_head *next = batch->next;
+      batch->func(batch);
+      batch = next;
+    }
+  }
+  return 0;
+}
+
+static void start_reclaimer()
+{
+  tbthread_t      thread;
+  tbthread_attr_t attr;
+  tbthread_attr_init(&attr);
+  tbthread_attr_setdetachstate(&attr, TBTHREAD_CREATE_DETACHED);
+  int st = tbthread_create(&thread, &attr, reclaimer_func, 0);
+  if(st)
+    tbprint("Unable to start the RCU reclaimer: %s\n", tbstrerror(-st));
+}
+
+void tb_call_rcu(struct tb_rcu_head *head, void (*func)(struct tb_rcu_head *))
+{
+  tbthread_once(&reclaimer_once, start_reclaimer);
+  head->func = func;
+  struct tb_rcu_head *next;
+  do {
+    next = cb_head;
+    head->next = next;
+  } while(!__sync_bool_compare_and_swap(&cb_head, next, head));
+
+  if(__sync_bool_compare_and_swap(&cb_futex, 1, 0))
+    SYSCALL3(__NR_futex, &cb_futex, FUTEX_WAKE, 1);
+}
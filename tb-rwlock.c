@@ -21,83 +21,382 @@
 #include "tb-private.h"
 
 #include <limits.h>
+#include <string.h>
 #include <linux/futex.h>
 
 //------------------------------------------------------------------------------
-// Lock for reading
+// The whole state of the lock lives in one word: the writer bit, the bits
+// telling that there may be writers, readers or an upgrader sleeping, the
+// upgrader bit, the read phase bit of the phase-fair mode, and the reader
+// count. The upgrader is counted as a reader.
 //------------------------------------------------------------------------------
-int tbthread_rwlock_rdlock(tbthread_rwlock_t *rwlock)
+#define RW_WRITER   0x80000000
+#define RW_WR_WAIT  0x40000000
+#define RW_RD_WAIT  0x20000000
+#define RW_UPGRADER 0x10000000
+#define RW_UP_WAIT  0x08000000
+#define RW_RD_PHASE 0x04000000
+#define RW_READERS  0x03ffffff
+
+//------------------------------------------------------------------------------
+// Init attributes
+//------------------------------------------------------------------------------
+int tbthread_rwlockattr_init(tbthread_rwlockattr_t *attr)
+{
+  memset(attr, 0, sizeof(tbthread_rwlockattr_t));
+  attr->wake_order = TBTHREAD_WAKE_DEFAULT;
+  attr->kind = TBTHREAD_RWLOCK_PREFER_WRITER;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy attributes - no op
+//------------------------------------------------------------------------------
+int tbthread_rwlockattr_destroy(tbthread_rwlockattr_t *attr)
+{
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Set the wake up order
+//------------------------------------------------------------------------------
+int tbthread_rwlockattr_setwakeorder(tbthread_rwlockattr_t *attr, int order)
+{
+  if(order != TBTHREAD_WAKE_DEFAULT && order != TBTHREAD_WAKE_PRIORITY)
+    return -EINVAL;
+  attr->wake_order = order;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Set the reader/writer preference
+//------------------------------------------------------------------------------
+int tbthread_rwlockattr_setkind(tbthread_rwlockattr_t *attr, int kind)
+{
+  if(kind != TBTHREAD_RWLOCK_PREFER_WRITER &&
+     kind != TBTHREAD_RWLOCK_PREFER_READER &&
+     kind != TBTHREAD_RWLOCK_PHASE_FAIR)
+    return -EINVAL;
+  attr->kind = kind;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Initialize the rwlock
+//------------------------------------------------------------------------------
+int tbthread_rwlock_init(tbthread_rwlock_t *rwlock,
+  const tbthread_rwlockattr_t *attr)
+{
+  memset(rwlock, 0, sizeof(tbthread_rwlock_t));
+  rwlock->wake_order = TBTHREAD_WAKE_DEFAULT;
+  rwlock->kind = TBTHREAD_RWLOCK_PREFER_WRITER;
+  if(attr) {
+    rwlock->wake_order = attr->wake_order;
+    rwlock->kind = attr->kind;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy the rwlock
+//------------------------------------------------------------------------------
+int tbthread_rwlock_destroy(tbthread_rwlock_t *rwlock)
+{
+  if(rwlock->state & (RW_WRITER | RW_READERS))
+    return -EBUSY;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Sleep and wake up in the order requested by the user; the waiters sleep on
+// sequence numbers that are bumped before every wake up
+//------------------------------------------------------------------------------
+static void rwlock_sleep(tbthread_rwlock_t *rwlock, int *futex, int val)
+{
+  if(rwlock->wake_order == TBTHREAD_WAKE_PRIORITY)
+    tb_waitq_wait(futex, val);
+  else
+    SYSCALL3(__NR_futex, futex, FUTEX_WAIT, val);
+}
+
+static int rwlock_wake(tbthread_rwlock_t *rwlock, int *futex, int num)
+{
+  __sync_fetch_and_add(futex, 1);
+  if(rwlock->wake_order == TBTHREAD_WAKE_PRIORITY)
+    return tb_waitq_wake(futex, num);
+  return SYSCALL3(__NR_futex, futex, FUTEX_WAKE, num);
+}
+
+//------------------------------------------------------------------------------
+// Wake up the waiters whose bits the caller has cleared. If none of them was
+// actually sleeping, give the other side a chance, so that nobody is left
+// sleeping with nobody to wake them up.
+//------------------------------------------------------------------------------
+static void wake_waiters(tbthread_rwlock_t *rwlock, uint32_t bits)
+{
+  if(bits & RW_WR_WAIT) {
+    if(rwlock_wake(rwlock, &rwlock->wr_futex, 1) > 0)
+      return;
+    bits = __sync_fetch_and_and(&rwlock->state, ~RW_RD_WAIT) & RW_RD_WAIT;
+    if(bits)
+      rwlock_wake(rwlock, &rwlock->rd_futex, INT_MAX);
+    return;
+  }
+
+  if(bits & RW_RD_WAIT) {
+    if(rwlock_wake(rwlock, &rwlock->rd_futex, INT_MAX) > 0)
+      return;
+    uint32_t state = __sync_fetch_and_and(&rwlock->state,
+                                          ~(RW_WR_WAIT | RW_RD_PHASE));
+    if(state & RW_WR_WAIT)
+      rwlock_wake(rwlock, &rwlock->wr_futex, 1);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Check if a reader needs to wait. In the phase-fair mode, a read phase with
+// a writer waiting admits only the readers that were already waiting when the
+// phase began, ie. the ones that started waiting before the read sequence got
+// bumped to rd_phase. Everyone else waits for the next read phase, so that
+// the readers drain and let the writer in.
+//------------------------------------------------------------------------------
+static int reader_blocked(tbthread_rwlock_t *rwlock, uint32_t state,
+  int waiting, int since)
+{
+  if(state & (RW_WRITER | RW_UP_WAIT))
+    return 1;
+  if(rwlock->kind == TBTHREAD_RWLOCK_PREFER_READER)
+    return 0;
+  if(rwlock->kind == TBTHREAD_RWLOCK_PHASE_FAIR && (state & RW_RD_PHASE) &&
+     waiting &&
+     (int)(__atomic_load_n(&rwlock->rd_phase, __ATOMIC_ACQUIRE) - since) > 0)
+    return 0;
+  return state & RW_WR_WAIT;
+}
+
+//------------------------------------------------------------------------------
+// Acquire a read lock, possibly an upgradable one
+//------------------------------------------------------------------------------
+static int read_lock(tbthread_rwlock_t *rwlock, uint32_t upgrader)
 {
+  //----------------------------------------------------------------------------
+  // The sequence number needs to be read before the state, so that we cannot
+  // miss a wake up that happens after we have seen the lock busy
+  //----------------------------------------------------------------------------
+  int waiting = 0;
+  int since = 0;
   while(1) {
-    tb_futex_lock(&rwlock->lock);
+    int seq = rwlock->rd_futex;
+    uint32_t state = rwlock->state;
 
-    if(!rwlock->writer && !rwlock->writers_queued) {
-      ++rwlock->readers;
-      tb_futex_unlock(&rwlock->lock);
-      return 0;
+    if(!reader_blocked(rwlock, state, waiting, since) && !(state & upgrader)) {
+      if((state & RW_READERS) == RW_READERS)
+        return -EAGAIN;
+      if(__sync_bool_compare_and_swap(&rwlock->state, state,
+                                      (state+1) | upgrader))
+        return 0;
+      continue;
     }
-    int sleep_status = rwlock->rd_futex;
 
-    tb_futex_unlock(&rwlock->lock);
+    if(!waiting) {
+      waiting = 1;
+      since = seq;
+    }
 
-    SYSCALL3(__NR_futex, &rwlock->rd_futex, FUTEX_WAIT, sleep_status);
+    if(!(state & RW_RD_WAIT) &&
+       !__sync_bool_compare_and_swap(&rwlock->state, state,
+                                     state | RW_RD_WAIT))
+      continue;
+
+    rwlock_sleep(rwlock, &rwlock->rd_futex, seq);
   }
 }
 
+//------------------------------------------------------------------------------
+// Lock for reading
+//------------------------------------------------------------------------------
+int tbthread_rwlock_rdlock(tbthread_rwlock_t *rwlock)
+{
+  uint32_t state = rwlock->state;
+  if(!reader_blocked(rwlock, state, 0, 0) &&
+     (state & RW_READERS) != RW_READERS &&
+     __sync_bool_compare_and_swap(&rwlock->state, state, state+1))
+    return 0;
+  return read_lock(rwlock, 0);
+}
+
+//------------------------------------------------------------------------------
+// Lock for reading with the right to upgrade; there may be only one such
+// reader at a time
+//------------------------------------------------------------------------------
+int tbthread_rwlock_uprdlock(tbthread_rwlock_t *rwlock)
+{
+  int st = read_lock(rwlock, RW_UPGRADER);
+  if(st == 0)
+    rwlock->upgrader = tb_self();
+  return st;
+}
+
 //------------------------------------------------------------------------------
 // Lock for writing
 //------------------------------------------------------------------------------
 int tbthread_rwlock_wrlock(tbthread_rwlock_t *rwlock)
 {
-  int queued = 0;
+  if(__sync_bool_compare_and_swap(&rwlock->state, 0, RW_WRITER))
+    return 0;
+
+  //----------------------------------------------------------------------------
+  // Only one writer is woken up at a time, so once we have slept, we set the
+  // waiting bit when taking the lock in case there are more writers sleeping.
+  // Taking the lock ends the read phase.
+  //----------------------------------------------------------------------------
+  uint32_t slept = 0;
   while(1) {
-    tb_futex_lock(&rwlock->lock);
+    int seq = rwlock->wr_futex;
+    uint32_t state = rwlock->state;
 
-    if(!queued) {
-      queued = 1;
-      ++rwlock->writers_queued;
+    if(!(state & (RW_WRITER | RW_READERS))) {
+      uint32_t new_state = (state | RW_WRITER | slept) & ~RW_RD_PHASE;
+      if(__sync_bool_compare_and_swap(&rwlock->state, state, new_state))
+        return 0;
+      continue;
     }
 
-    if(!rwlock->writer && !rwlock->readers) {
-      rwlock->writer = tbthread_self();
-      --rwlock->writers_queued;
-      tb_futex_unlock(&rwlock->lock);
+    if(!(state & RW_WR_WAIT) &&
+       !__sync_bool_compare_and_swap(&rwlock->state, state,
+                                     state | RW_WR_WAIT))
+      continue;
+
+    rwlock_sleep(rwlock, &rwlock->wr_futex, seq);
+    slept = RW_WR_WAIT;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Upgrade the upgradable read lock to a write lock, without letting anyone
+// else in. New readers are held back while we wait for the current ones.
+//------------------------------------------------------------------------------
+int tbthread_rwlock_upgrade(tbthread_rwlock_t *rwlock)
+{
+  if(!(rwlock->state & RW_UPGRADER) || rwlock->upgrader != tb_self())
+    return -EPERM;
+
+  while(1) {
+    uint32_t state = rwlock->state;
+    if((state & RW_READERS) == 1) {
+      uint32_t new_state = state - 1;
+      new_state &= ~(RW_UPGRADER | RW_UP_WAIT | RW_RD_PHASE);
+      new_state |= RW_WRITER;
+      if(!__sync_bool_compare_and_swap(&rwlock->state, state, new_state))
+        continue;
+      rwlock->upgrader = 0;
       return 0;
     }
-    int sleep_status = rwlock->wr_futex;
 
-    tb_futex_unlock(&rwlock->lock);
-
-    SYSCALL3(__NR_futex, &rwlock->wr_futex, FUTEX_WAIT, sleep_status);
+    if(!(state & RW_UP_WAIT)) {
+      if(!__sync_bool_compare_and_swap(&rwlock->state, state,
+                                       state | RW_UP_WAIT))
+        continue;
+      state |= RW_UP_WAIT;
+    }
+    SYSCALL3(__NR_futex, &rwlock->state, FUTEX_WAIT, state);
   }
 }
 
+//------------------------------------------------------------------------------
+// Turn the write lock into a read lock, without letting any writer in
+//------------------------------------------------------------------------------
+int tbthread_rwlock_downgrade(tbthread_rwlock_t *rwlock)
+{
+  uint32_t state, new_state;
+  if(!(rwlock->state & RW_WRITER))
+    return -EPERM;
+
+  do {
+    state = rwlock->state;
+    new_state = (state & ~(RW_WRITER | RW_RD_WAIT)) + 1;
+  } while(!__sync_bool_compare_and_swap(&rwlock->state, state, new_state));
+
+  if(state & RW_RD_WAIT)
+    rwlock_wake(rwlock, &rwlock->rd_futex, INT_MAX);
+  return 0;
+}
+
 //------------------------------------------------------------------------------
 // Unlock
 //------------------------------------------------------------------------------
 int tbthread_rwlock_unlock(tbthread_rwlock_t *rwlock)
 {
-  tb_futex_lock(&rwlock->lock);
-  if(rwlock->writer) {
-    rwlock->writer = 0;
-    if(rwlock->writers_queued) {
-      __sync_fetch_and_add(&rwlock->wr_futex, 1);
-      SYSCALL3(__NR_futex, &rwlock->wr_futex, FUTEX_WAKE, 1);
-    } else {
-      __sync_fetch_and_add(&rwlock->rd_futex, 1);
-      SYSCALL3(__NR_futex, &rwlock->rd_futex, FUTEX_WAKE, INT_MAX);
-    }
-    goto exit;
+  uint32_t state = rwlock->state;
+  uint32_t new_state;
+  uint32_t bits;
+
+  //----------------------------------------------------------------------------
+  // Writer; depending on the preference, wake up one writer or all the
+  // readers. The other side keeps its waiting bit. In the phase-fair mode
+  // the woken readers get a read phase even though a writer is waiting; the
+  // read sequence is bumped before the phase begins, so that the readers
+  // coming after it can tell that they are late.
+  //----------------------------------------------------------------------------
+  if(state & RW_WRITER) {
+    do {
+      state = rwlock->state;
+      new_state = state & ~(RW_WRITER | RW_RD_PHASE);
+      if((state & RW_WR_WAIT) &&
+         (rwlock->kind == TBTHREAD_RWLOCK_PREFER_WRITER ||
+          !(state & RW_RD_WAIT)))
+        bits = RW_WR_WAIT;
+      else {
+        bits = state & RW_RD_WAIT;
+        if(bits && (state & RW_WR_WAIT) &&
+           rwlock->kind == TBTHREAD_RWLOCK_PHASE_FAIR) {
+          new_state |= RW_RD_PHASE;
+          __atomic_store_n(&rwlock->rd_phase,
+                           __sync_add_and_fetch(&rwlock->rd_futex, 1),
+                           __ATOMIC_RELEASE);
+        }
+      }
+      new_state &= ~bits;
+    } while(!__sync_bool_compare_and_swap(&rwlock->state, state, new_state));
+    wake_waiters(rwlock, bits);
+    return 0;
+  }
+
+  //----------------------------------------------------------------------------
+  // Upgradable reader; let the next upgrader in
+  //----------------------------------------------------------------------------
+  if((state & RW_UPGRADER) && rwlock->upgrader == tb_self()) {
+    rwlock->upgrader = 0;
+    do {
+      state = rwlock->state;
+      new_state = (state - 1) & ~(RW_UPGRADER | RW_RD_WAIT);
+    } while(!__sync_bool_compare_and_swap(&rwlock->state, state, new_state));
+    if(state & RW_RD_WAIT)
+      rwlock_wake(rwlock, &rwlock->rd_futex, INT_MAX);
   }
 
-  --rwlock->readers;
-  if(!rwlock->readers && rwlock->writers_queued) {
-    __sync_fetch_and_add(&rwlock->wr_futex, 1);
-    SYSCALL3(__NR_futex, &rwlock->wr_futex, FUTEX_WAKE, 1);
+  //----------------------------------------------------------------------------
+  // Reader; the upgrader waits for being the only one left
+  //----------------------------------------------------------------------------
+  else {
+    state = __sync_fetch_and_sub(&rwlock->state, 1);
+    if((state & RW_UP_WAIT) && (state & RW_READERS) == 2)
+      SYSCALL3(__NR_futex, &rwlock->state, FUTEX_WAKE, 1);
   }
 
-exit:
-  tb_futex_unlock(&rwlock->lock);
+  //----------------------------------------------------------------------------
+  // Only the last one out needs to care about the sleeping writers
+  //----------------------------------------------------------------------------
+  if((state & RW_READERS) != 1 || !(state & RW_WR_WAIT))
+    return 0;
+
+  do {
+    state = rwlock->state;
+    if(state & (RW_WRITER | RW_READERS) || !(state & RW_WR_WAIT))
+      return 0;
+  } while(!__sync_bool_compare_and_swap(&rwlock->state, state,
+                                        state & ~(RW_WR_WAIT | RW_RD_PHASE)));
+  wake_waiters(rwlock, RW_WR_WAIT);
   return 0;
 }
 
@@ -106,16 +405,15 @@ exit:
 //------------------------------------------------------------------------------
 int tbthread_rwlock_tryrdlock(tbthread_rwlock_t *rwlock)
 {
-  tb_futex_lock(&rwlock->lock);
-  int status = -EBUSY;
-  if(!rwlock->writer && !rwlock->writers_queued) {
-    ++rwlock->readers;
-    status = 0;
-    goto exit;
+  while(1) {
+    uint32_t state = rwlock->state;
+    if(reader_blocked(rwlock, state, 0, 0))
+      return -EBUSY;
+    if((state & RW_READERS) == RW_READERS)
+      return -EAGAIN;
+    if(__sync_bool_compare_and_swap(&rwlock->state, state, state+1))
+      return 0;
   }
-exit:
-  tb_futex_unlock(&rwlock->lock);
-  return status;
 }
 
 //------------------------------------------------------------------------------
@@ -123,14 +421,12 @@ exit:
 //------------------------------------------------------------------------------
 int tbthread_rwlock_trywrlock(tbthread_rwlock_t *rwlock)
 {
-  tb_futex_lock(&rwlock->lock);
-  int status = -EBUSY;
-  if(!rwlock->writer && !rwlock->readers) {
-    rwlock->writer = tbthread_self();
-    status = 0;
-    goto exit;
+  while(1) {
+    uint32_t state = rwlock->state;
+    if(state & (RW_WRITER | RW_READERS))
+      return -EBUSY;
+    if(__sync_bool_compare_and_swap(&rwlock->state, state,
+                                    (state | RW_WRITER) & ~RW_RD_PHASE))
+      return 0;
   }
-exit:
-  tb_futex_unlock(&rwlock->lock);
-  return status;
 }
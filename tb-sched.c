@@ -20,7 +20,6 @@
 #include "tb.h"
 #include "tb-private.h"
 
-#include <string.h>
 
 //------------------------------------------------------------------------------
 // Set scheduler
@@ -30,7 +29,7 @@ struct tb_sched_param
   int sched_priority;
 };
 
-int tb_set_sched(tbthread_t thread, int policy, int priority)
+int tb_set_sched(struct tbthread *thread, int policy, int priority)
 {
   struct tb_sched_param p; p.sched_priority = priority;
   int ret = SYSCALL3(__NR_sched_setscheduler, thread->tid, policy, &p);
@@ -40,218 +39,244 @@ int tb_set_sched(tbthread_t thread, int policy, int priority)
 }
 
 //------------------------------------------------------------------------------
-// Schedule a protected mutex
+// Compare scheduling info; higher priority wins, at equal priority anything
+// wins over SCHED_RR
 //------------------------------------------------------------------------------
-static int mutex_prio_smaller(void *this, void *next)
+static int sched_info_key(uint16_t sched_info)
 {
-  tbthread_mutex_t *t = this;
-  tbthread_mutex_t *n = next;
-  if(SCHED_INFO_PRIORITY(n->sched_info) < SCHED_INFO_PRIORITY(t->sched_info))
-    return 1;
-  return 0;
+  int key = SCHED_INFO_PRIORITY(sched_info) << 1;
+  if(SCHED_INFO_POLICY(sched_info) != SCHED_RR)
+    key |= 1;
+  return key;
 }
 
-void tb_protect_mutex_sched(tbthread_mutex_t *mutex)
+//------------------------------------------------------------------------------
+// Scheduling info that the mutex imposes on its owner
+//------------------------------------------------------------------------------
+static uint16_t mutex_sched_info(tbthread_mutex_t *mutex)
 {
-  tbthread_t owner = mutex->owner;
-  tb_futex_lock(&owner->lock);
+  if(mutex->protocol == TBTHREAD_PRIO_PROTECT)
+    return mutex->sched_info;
+  return mutex->inherit_sched_info;
+}
 
-  list_t *node = malloc(sizeof(list_t));
-  if(!node)
-    goto exit;
+//------------------------------------------------------------------------------
+// Priority heap of the mutexes owned by a thread. The mutexes remember their
+// position in the heap (counting from one, zero means not in the heap), so
+// that we can remove or update them without searching.
+//------------------------------------------------------------------------------
+static int heap_key(struct tbthread *thread, int pos)
+{
+  return sched_info_key(mutex_sched_info(thread->prio_heap[pos]));
+}
 
-  node->element = mutex;
-  list_add_here(&owner->protect_mutexes, node, mutex_prio_smaller);
+static void heap_set(struct tbthread *thread, int pos, tbthread_mutex_t *mutex)
+{
+  thread->prio_heap[pos] = mutex;
+  mutex->prio_index = pos+1;
+}
 
-  if(node->prev == &owner->protect_mutexes)
-    tb_compute_sched(owner);
+static void heap_sift_up(struct tbthread *thread, int pos)
+{
+  tbthread_mutex_t *mutex = thread->prio_heap[pos];
+  int key = sched_info_key(mutex_sched_info(mutex));
+  while(pos) {
+    int parent = (pos-1)/2;
+    if(heap_key(thread, parent) >= key)
+      break;
+    heap_set(thread, pos, thread->prio_heap[parent]);
+    pos = parent;
+  }
+  heap_set(thread, pos, mutex);
+}
 
-exit:
-  tb_futex_unlock(&owner->lock);
+static void heap_sift_down(struct tbthread *thread, int pos)
+{
+  tbthread_mutex_t *mutex = thread->prio_heap[pos];
+  int key = sched_info_key(mutex_sched_info(mutex));
+  int size = thread->prio_heap_size;
+  while(1) {
+    int child = 2*pos+1;
+    if(child >= size)
+      break;
+    if(child+1 < size && heap_key(thread, child+1) > heap_key(thread, child))
+      ++child;
+    if(heap_key(thread, child) <= key)
+      break;
+    heap_set(thread, pos, thread->prio_heap[child]);
+    pos = child;
+  }
+  heap_set(thread, pos, mutex);
+}
+
+static int heap_push(struct tbthread *thread, tbthread_mutex_t *mutex)
+{
+  mutex->prio_index = 0;
+  if(thread->prio_heap_size == TBTHREAD_MAX_PRIO_MUTEXES)
+    return -EAGAIN;
+  thread->prio_heap[thread->prio_heap_size] = mutex;
+  heap_sift_up(thread, thread->prio_heap_size++);
+  return 0;
+}
+
+static void heap_remove(struct tbthread *thread, tbthread_mutex_t *mutex)
+{
+  if(!mutex->prio_index)
+    return;
+  int pos = mutex->prio_index-1;
+  mutex->prio_index = 0;
+  --thread->prio_heap_size;
+  if(pos == thread->prio_heap_size)
+    return;
+  thread->prio_heap[pos] = thread->prio_heap[thread->prio_heap_size];
+  heap_sift_down(thread, pos);
+  heap_sift_up(thread, thread->prio_heap[pos]->prio_index-1);
 }
 
 //------------------------------------------------------------------------------
-// Un-schedule a protected mutex
+// Schedule a protected mutex, fail if the owner holds too many priority
+// mutexes already
 //------------------------------------------------------------------------------
-void tb_protect_mutex_unsched(tbthread_mutex_t *mutex)
+int tb_protect_mutex_sched(tbthread_mutex_t *mutex)
 {
-  tbthread_t owner = mutex->owner;
+  struct tbthread *owner = mutex->owner;
   tb_futex_lock(&owner->lock);
-  int reschedule = 0;
-  list_t *node = list_find_elem(&owner->protect_mutexes, mutex);
-  if(node) {
-    if(node->prev == &owner->protect_mutexes)
-      reschedule = 1;
-    list_rm(node);
-    free(node);
-  }
-
-  if(reschedule)
+  int ret = heap_push(owner, mutex);
+  if(!ret)
     tb_compute_sched(owner);
   tb_futex_unlock(&owner->lock);
+  return ret;
 }
 
 //------------------------------------------------------------------------------
-// Add an inherit mutex
+// Un-schedule a protected mutex
 //------------------------------------------------------------------------------
-struct inh_mutex {
-  tbthread_mutex_t *mutex;
-  uint16_t sched_info;
-};
-
-void tb_inherit_mutex_add(tbthread_mutex_t *mutex)
+void tb_protect_mutex_unsched(tbthread_mutex_t *mutex)
 {
-  tbthread_t owner = mutex->owner;
+  struct tbthread *owner = mutex->owner;
   tb_futex_lock(&owner->lock);
-
-  list_t *node = malloc(sizeof(list_t));
-  if(!node)
-    goto exit;
-
-  struct inh_mutex *el = malloc(sizeof(struct inh_mutex));
-  if(!el) {
-    free(node);
-    goto exit;
-  }
-  memset(el, 0, sizeof(struct inh_mutex));
-
-  el->mutex = mutex;
-  node->element = el;
-  list_add(&owner->inherit_mutexes, node, 0);
-
-exit:
+  heap_remove(owner, mutex);
+  tb_compute_sched(owner);
   tb_futex_unlock(&owner->lock);
 }
 
 //------------------------------------------------------------------------------
-// Un-schedule an inherit mutex
+// Add an inherit mutex, fail if the owner holds too many priority mutexes
+// already
 //------------------------------------------------------------------------------
-static int mutex_equal(void *this, void *other)
+int tb_inherit_mutex_add(tbthread_mutex_t *mutex)
 {
-  struct inh_mutex *o = other;
-  return this == o->mutex;
+  struct tbthread *owner = mutex->owner;
+  tb_futex_lock(&owner->lock);
+  mutex->inherit_sched_info = 0;
+  int ret = heap_push(owner, mutex);
+  tb_futex_unlock(&owner->lock);
+  return ret;
 }
 
+//------------------------------------------------------------------------------
+// Un-schedule an inherit mutex
+//------------------------------------------------------------------------------
 void tb_inherit_mutex_unsched(tbthread_mutex_t *mutex)
 {
-  tbthread_t owner = mutex->owner;
+  struct tbthread *owner = mutex->owner;
   tb_futex_lock(&owner->lock);
-
-  list_t *node = list_find_elem_func(&owner->inherit_mutexes, mutex,
-    mutex_equal);
-
-  if(!node)
-    goto exit;
-
-  struct inh_mutex *im = node->element;
-  list_rm(node);
-  free(node);
-
-  if(im->sched_info == owner->sched_info)
-    tb_compute_sched(owner);
-
-  free(im);
-
-exit:
+  heap_remove(owner, mutex);
+  mutex->inherit_sched_info = 0;
+  tb_compute_sched(owner);
   tb_futex_unlock(&owner->lock);
 }
 
 //------------------------------------------------------------------------------
-// Schedule an inherit mutex
+// Schedule an inherit mutex, return the owner if it got boosted
 //------------------------------------------------------------------------------
-void tb_inherit_mutex_sched(tbthread_mutex_t *mutex, tbthread_t thread)
+struct tbthread *tb_inherit_mutex_sched(tbthread_mutex_t *mutex,
+  struct tbthread *thread)
 {
   tb_futex_lock(&thread->lock);
-  int th_sched_info = thread->sched_info;
+  uint16_t th_sched_info = thread->sched_info;
   tb_futex_unlock(&thread->lock);
 
-  tbthread_t owner = mutex->owner;
+  struct tbthread *owner = mutex->owner;
+  struct tbthread *boosted = 0;
   tb_futex_lock(&owner->lock);
 
-  list_t *node = list_find_elem_func(&owner->inherit_mutexes, mutex,
-    mutex_equal);
+  if(mutex->prio_index &&
+     sched_info_key(th_sched_info) >
+     sched_info_key(mutex->inherit_sched_info)) {
+    mutex->inherit_sched_info = th_sched_info;
+    heap_sift_up(owner, mutex->prio_index-1);
+    uint16_t old_sched_info = owner->sched_info;
+    tb_compute_sched(owner);
+    if(owner->sched_info != old_sched_info)
+      boosted = owner;
+  }
 
-  if(!node)
-    goto exit;
+  tb_futex_unlock(&owner->lock);
+  return boosted;
+}
 
-  struct inh_mutex *im = node->element;
-  int reschedule = 0;
+//------------------------------------------------------------------------------
+// Propagate the boost along the chain of inherit mutexes. If the thread that we
+// have just boosted is itself blocked on an inherit mutex, the owner of that
+// mutex needs the boost as well, and so on. We stop when a boost does not
+// change anything or when we come back to the thread that started the walk,
+// which means that we have a deadlock. The boosts are stored in the mutexes,
+// so they are undone when the mutexes are unlocked. The owners may exit and
+// be joined while we follow them, so the caller starts a descriptor walk
+// while it still holds the lock of the first mutex.
+//------------------------------------------------------------------------------
+#define PI_CHAIN_MAX 1024
 
-  if(SCHED_INFO_PRIORITY(th_sched_info) > SCHED_INFO_PRIORITY(im->sched_info)) {
-    im->sched_info = th_sched_info;
-    reschedule = 1;
+void tb_inherit_chain_sched(struct tbthread *thread, struct tbthread *origin)
+{
+  for(int depth = 0; thread && depth < PI_CHAIN_MAX; ++depth) {
+    tb_futex_lock(&thread->lock);
+    tbthread_mutex_t *mutex = thread->blocked_on;
+    tb_futex_unlock(&thread->lock);
+    if(!mutex)
+      return;
+
+    struct tbthread *owner = 0;
+    tb_futex_lock(&mutex->internal_futex);
+    if(thread->blocked_on == mutex && mutex->futex &&
+       mutex->owner != origin)
+      owner = tb_inherit_mutex_sched(mutex, thread);
+    tb_futex_unlock(&mutex->internal_futex);
+    thread = owner;
   }
-  else
-    if(SCHED_INFO_PRIORITY(th_sched_info) == SCHED_INFO_PRIORITY(im->sched_info)
-       && SCHED_INFO_POLICY(im->sched_info) == SCHED_RR) {
-      im->sched_info = th_sched_info;
-      reschedule = 1;
-    }
-
-  if(reschedule)
-    tb_compute_sched(owner);
-
-exit:
-  tb_futex_unlock(&owner->lock);
 }
 
 //------------------------------------------------------------------------------
 // Compute scheduler
 //------------------------------------------------------------------------------
-int tb_compute_sched(tbthread_t thread)
+int tb_compute_sched(struct tbthread *thread)
 {
   //----------------------------------------------------------------------------
-  // Take the user set scheduler into account
+  // Take the user set scheduler into account and the most demanding mutex
+  // owned by the thread; it sits on top of the heap
   //----------------------------------------------------------------------------
   uint16_t sched_info = thread->user_sched_info;
-  uint8_t policy = SCHED_INFO_POLICY(sched_info);
-  uint8_t priority = SCHED_INFO_PRIORITY(sched_info);
-
-  //----------------------------------------------------------------------------
-  // Look at priority protect mutexes owned by the thread
-  //----------------------------------------------------------------------------
-  if(thread->protect_mutexes.next)
-  {
-    tbthread_mutex_t *protect_mutex = thread->protect_mutexes.next->element;
-    uint16_t prot_sched_info = protect_mutex->sched_info;
-    uint8_t prot_policy = SCHED_INFO_POLICY(prot_sched_info);
-    uint8_t prot_priority = SCHED_INFO_PRIORITY(prot_sched_info);
-
-    if(prot_priority > priority) {
-      priority = prot_priority;
-      policy = prot_policy;
-    }
-    else if(prot_priority == priority && policy == SCHED_RR)
-      policy = prot_policy;
+  if(thread->prio_heap_size) {
+    uint16_t mutex_info = mutex_sched_info(thread->prio_heap[0]);
+    if(sched_info_key(mutex_info) > sched_info_key(sched_info))
+      sched_info = mutex_info;
   }
 
   //----------------------------------------------------------------------------
-  // Look at priority inherit mutexes owned by the thread
+  // Don't bother the kernel if nothing has changed
   //----------------------------------------------------------------------------
-  if(thread->inherit_mutexes.next)
-  {
-    list_t *cursor = thread->inherit_mutexes.next;
-    for( ; cursor; cursor = cursor->next) {
-      struct inh_mutex *im = cursor->element;
-      uint8_t im_policy = SCHED_INFO_POLICY(im->sched_info);
-      uint8_t im_priority = SCHED_INFO_PRIORITY(im->sched_info);
-
-      if(im_priority > priority) {
-        priority = im_priority;
-        policy = im_policy;
-      }
-      else if(im_priority == priority && policy == SCHED_RR)
-        policy = im_policy;
-    }
-  }
+  if(sched_info == thread->sched_info)
+    return 0;
 
-  return tb_set_sched(thread, policy, priority);
+  return tb_set_sched(thread, SCHED_INFO_POLICY(sched_info),
+                      SCHED_INFO_PRIORITY(sched_info));
 }
 
 //------------------------------------------------------------------------------
 // Set scheduling parameters
 //------------------------------------------------------------------------------
-int tbthread_setschedparam(tbthread_t thread, int policy, int priority)
+int tbthread_setschedparam(tbthread_t handle, int policy, int priority)
 {
   if(policy != SCHED_NORMAL && policy != SCHED_FIFO && policy != SCHED_RR)
     return -EINVAL;
@@ -259,44 +284,30 @@ int tbthread_setschedparam(tbthread_t thread, int policy, int priority)
   if(priority < 0 || priority > 99)
     return -EINVAL;
 
-  int ret = 0;
-  tbthread_mutex_lock(&desc_mutex);
-
-  if(!list_find_elem(&used_desc, thread)) {
-    ret = -ESRCH;
-    goto exit;
-  }
+  struct tbthread *thread = tb_desc_lookup(handle);
+  if(!thread)
+    return -ESRCH;
 
   thread->user_sched_info = SCHED_INFO_PACK(policy, priority);
   tb_futex_lock(&thread->lock);
-  ret = tb_compute_sched(thread);
+  int ret = tb_compute_sched(thread);
   tb_futex_unlock(&thread->lock);
-
-exit:
-  tbthread_mutex_unlock(&desc_mutex);
   return ret;
 }
 
 //------------------------------------------------------------------------------
 // Get scheduling parameters
 //------------------------------------------------------------------------------
-int tbthread_getschedparam(tbthread_t thread, int *policy, int *priority)
+int tbthread_getschedparam(tbthread_t handle, int *policy, int *priority)
 {
-  int ret = 0;
-  tbthread_mutex_lock(&desc_mutex);
-
-  if(!list_find_elem(&used_desc, thread)) {
-    ret = -ESRCH;
-    goto exit;
-  }
+  struct tbthread *thread = tb_desc_lookup(handle);
+  if(!thread)
+    return -ESRCH;
 
   uint16_t si = thread->sched_info;
   *policy = SCHED_INFO_POLICY(si);
   *priority = SCHED_INFO_PRIORITY(si);
-
-exit:
-  tbthread_mutex_unlock(&desc_mutex);
-  return ret;
+  return 0;
 }
 
 //------------------------------------------------------------------------------
@@ -0,0 +1,219 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+
+//------------------------------------------------------------------------------
+// The whole semaphore is one 64-bit word: the count lives in the low 32 bits,
+// the number of waiters in the next 31 bits, and the top bit says that some
+// waiter wants more than one unit. The waiters sleep on the count half of the
+// word, so a post between reading the count and going to sleep makes the
+// futex call fail instead of getting lost. When nobody waits for a batch, a
+// post of n units wakes at most n waiters; otherwise it wakes everyone, since
+// the kernel may pick a waiter that needs more than what is available.
+//------------------------------------------------------------------------------
+#define SEM_COUNT   0x00000000ffffffffULL
+#define SEM_WAITER  0x0000000100000000ULL
+#define SEM_WAITERS 0x7fffffff00000000ULL
+#define SEM_BATCH   0x8000000000000000ULL
+
+#define SEM_FUTEX(sem) ((int *)&(sem)->value)
+
+//------------------------------------------------------------------------------
+// Initialize the semaphore
+//------------------------------------------------------------------------------
+int tbthread_sem_init(tbthread_sem_t *sem, unsigned value)
+{
+  if(value > TBTHREAD_SEM_VALUE_MAX)
+    return -EINVAL;
+  sem->value = value;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy the semaphore
+//------------------------------------------------------------------------------
+int tbthread_sem_destroy(tbthread_sem_t *sem)
+{
+  if(sem->value & SEM_WAITERS)
+    return -EBUSY;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Get the value
+//------------------------------------------------------------------------------
+int tbthread_sem_getvalue(tbthread_sem_t *sem, int *value)
+{
+  *value = sem->value & SEM_COUNT;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Release n units
+//------------------------------------------------------------------------------
+int tbthread_sem_post_n(tbthread_sem_t *sem, unsigned n)
+{
+  uint64_t value;
+  do {
+    value = sem->value;
+    if((value & SEM_COUNT) + n > TBTHREAD_SEM_VALUE_MAX)
+      return -EOVERFLOW;
+  } while(!__sync_bool_compare_and_swap(&sem->value, value, value + n));
+
+  if(!(value & SEM_WAITERS))
+    return 0;
+
+  tb_waitany_notify();
+
+  int wake = n;
+  if(value & SEM_BATCH)
+    wake = INT_MAX;
+  SYSCALL3(__NR_futex, SEM_FUTEX(sem), FUTEX_WAKE, wake);
+  return 0;
+}
+
+int tbthread_sem_post(tbthread_sem_t *sem)
+{
+  return tbthread_sem_post_n(sem, 1);
+}
+
+//------------------------------------------------------------------------------
+// Try to take n units without blocking
+//------------------------------------------------------------------------------
+int tbthread_sem_trywait_n(tbthread_sem_t *sem, unsigned n)
+{
+  uint64_t value;
+  do {
+    value = sem->value;
+    if((value & SEM_COUNT) < n)
+      return -EAGAIN;
+  } while(!__sync_bool_compare_and_swap(&sem->value, value, value - n));
+  return 0;
+}
+
+int tbthread_sem_trywait(tbthread_sem_t *sem)
+{
+  return tbthread_sem_trywait_n(sem, 1);
+}
+
+//------------------------------------------------------------------------------
+// Unregister a waiter; the last waiter out clears the batch flag
+//------------------------------------------------------------------------------
+static uint64_t unregister_waiter(uint64_t value)
+{
+  value -= SEM_WAITER;
+  if(!(value & SEM_WAITERS))
+    value &= ~SEM_BATCH;
+  return value;
+}
+
+//------------------------------------------------------------------------------
+// Register and unregister a waiter that may not take the units when woken
+// up, so the posts need to wake everybody
+//------------------------------------------------------------------------------
+void tb_sem_register(tbthread_sem_t *sem)
+{
+  __sync_fetch_and_add(&sem->value, SEM_WAITER);
+  __sync_fetch_and_or(&sem->value, SEM_BATCH);
+}
+
+void tb_sem_unregister(tbthread_sem_t *sem)
+{
+  uint64_t value;
+  do
+    value = sem->value;
+  while(!__sync_bool_compare_and_swap(&sem->value, value,
+                                      unregister_waiter(value)));
+}
+
+//------------------------------------------------------------------------------
+// Take a unit if there is one; otherwise tell the caller what value to sleep
+// on and where
+//------------------------------------------------------------------------------
+int tb_sem_arm(tbthread_sem_t *sem, int **futex, uint32_t *expected)
+{
+  uint64_t value;
+  do {
+    value = sem->value;
+    if(!(value & SEM_COUNT)) {
+      *futex = SEM_FUTEX(sem);
+      *expected = value & SEM_COUNT;
+      return 0;
+    }
+  } while(!__sync_bool_compare_and_swap(&sem->value, value, value - 1));
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+// Take n units, wait until the absolute CLOCK_REALTIME timeout if not null
+//------------------------------------------------------------------------------
+int tbthread_sem_timedwait_n(tbthread_sem_t *sem, unsigned n,
+  const struct timespec *abstime)
+{
+  if(n == 0 || n > TBTHREAD_SEM_VALUE_MAX)
+    return -EINVAL;
+
+  if(tbthread_sem_trywait_n(sem, n) == 0)
+    return 0;
+
+  __sync_fetch_and_add(&sem->value, SEM_WAITER);
+  if(n > 1)
+    __sync_fetch_and_or(&sem->value, SEM_BATCH);
+
+  uint64_t value;
+  while(1) {
+    value = sem->value;
+    uint32_t count = value & SEM_COUNT;
+    if(count >= n) {
+      if(__sync_bool_compare_and_swap(&sem->value, value,
+                                      unregister_waiter(value - n)))
+        return 0;
+      continue;
+    }
+
+    long st = SYSCALL6(__NR_futex, SEM_FUTEX(sem),
+                       FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME, count,
+                       abstime, 0, FUTEX_BITSET_MATCH_ANY);
+    if(st == -ETIMEDOUT)
+      break;
+  }
+
+  tb_sem_unregister(sem);
+  return -ETIMEDOUT;
+}
+
+int tbthread_sem_timedwait(tbthread_sem_t *sem, const struct timespec *abstime)
+{
+  return tbthread_sem_timedwait_n(sem, 1, abstime);
+}
+
+int tbthread_sem_wait_n(tbthread_sem_t *sem, unsigned n)
+{
+  return tbthread_sem_timedwait_n(sem, n, 0);
+}
+
+int tbthread_sem_wait(tbthread_sem_t *sem)
+{
+  return tbthread_sem_timedwait_n(sem, 1, 0);
+}
@@ -0,0 +1,91 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+//------------------------------------------------------------------------------
+// The sequence is odd while a write is in progress. Readers never write to
+// the lock; they copy the data out and retry if the sequence has changed in
+// the meantime. The writers serialize among themselves on a futex lock.
+//------------------------------------------------------------------------------
+#define SEQLOCK_SPINS 1000
+
+//------------------------------------------------------------------------------
+// Initialize the seqlock
+//------------------------------------------------------------------------------
+int tbthread_seqlock_init(tbthread_seqlock_t *lock)
+{
+  lock->seq = 0;
+  lock->lock = 0;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Lock for writing
+//------------------------------------------------------------------------------
+void tbthread_seqlock_write_lock(tbthread_seqlock_t *lock)
+{
+  tb_futex_lock(&lock->lock);
+  __atomic_store_n(&lock->seq, lock->seq+1, __ATOMIC_RELAXED);
+
+  //----------------------------------------------------------------------------
+  // The odd sequence must be visible before any of the data stores
+  //----------------------------------------------------------------------------
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+//------------------------------------------------------------------------------
+// Unlock after writing
+//------------------------------------------------------------------------------
+void tbthread_seqlock_write_unlock(tbthread_seqlock_t *lock)
+{
+  __atomic_store_n(&lock->seq, lock->seq+1, __ATOMIC_RELEASE);
+  tb_futex_unlock(&lock->lock);
+}
+
+//------------------------------------------------------------------------------
+// Start reading; wait for the writer to finish if there is one
+//------------------------------------------------------------------------------
+uint32_t tbthread_seqlock_read_begin(const tbthread_seqlock_t *lock)
+{
+  uint32_t seq;
+  int spins = 0;
+  while((seq = __atomic_load_n(&lock->seq, __ATOMIC_ACQUIRE)) & 1) {
+    if(++spins < SEQLOCK_SPINS)
+      asm volatile("pause" ::: "memory");
+    else {
+      SYSCALL0(__NR_sched_yield);
+      spins = 0;
+    }
+  }
+  return seq;
+}
+
+//------------------------------------------------------------------------------
+// Check whether the data read since read_begin needs to be read again
+//------------------------------------------------------------------------------
+int tbthread_seqlock_read_retry(const tbthread_seqlock_t *lock, uint32_t seq)
+{
+  //----------------------------------------------------------------------------
+  // The data loads must complete before we look at the sequence again
+  //----------------------------------------------------------------------------
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&lock->seq, __ATOMIC_RELAXED) != seq;
+}
@@ -0,0 +1,205 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+#include <linux/mman.h>
+#include <asm-generic/mman-common.h>
+#include <asm-generic/param.h>
+
+//------------------------------------------------------------------------------
+// Stack cache. The stacks of the threads that have exited are kept on a list
+// and handed out again to the new threads that ask for the same size, guard,
+// and mode, which saves the mmap, the mprotect of the guard, and the page faults
+// on fresh memory. A stack is put in the cache only once its thread is known
+// to be gone, so the list node lives at the bottom of the stack itself, just
+// above the guard. The cached stacks are madvised with MADV_FREE, so that the
+// kernel can take their pages back when it runs short of memory, without us
+// having to notice. Up to STACK_CACHE_MAX worth of them are kept, the rest
+// are unmapped.
+//------------------------------------------------------------------------------
+#define STACK_CACHE_MAX (40 * 1024 * 1024)
+
+struct cached_stack
+{
+  struct cached_stack *next;
+  uint32_t size;
+  uint32_t guard;
+  int mode;
+};
+
+static struct cached_stack *stack_cache = 0;
+static uint64_t stack_cache_size = 0;
+static int stack_cache_lock = 0;
+
+//------------------------------------------------------------------------------
+// The descriptors live on top of the stacks, and the threads that walk the
+// registry or follow the owner of a mutex may look at the descriptor of a
+// thread that is already gone. They bracket the walk with
+// tb_desc_walk_begin and tb_desc_walk_end, and the stacks that do not fit in
+// the cache wait on the graveyard list until nobody walks. A stack enters the
+// graveyard only after its slot has forgotten the descriptor, so a walker
+// that starts afterwards cannot find it, and the one that started before is
+// seen by the reaper, which takes the list before it looks at the counter.
+//------------------------------------------------------------------------------
+static struct cached_stack *graveyard = 0;
+static uint32_t desc_walkers = 0;
+
+static void bury(struct cached_stack *first, struct cached_stack *last)
+{
+  struct cached_stack *head;
+  do {
+    head = __atomic_load_n(&graveyard, __ATOMIC_ACQUIRE);
+    last->next = head;
+  } while(!__sync_bool_compare_and_swap(&graveyard, head, first));
+}
+
+static void reap()
+{
+  struct cached_stack *list = __atomic_exchange_n(&graveyard, 0,
+                                                  __ATOMIC_SEQ_CST);
+  if(!list)
+    return;
+
+  if(__atomic_load_n(&desc_walkers, __ATOMIC_SEQ_CST)) {
+    struct cached_stack *last = list;
+    while(last->next)
+      last = last->next;
+    bury(list, last);
+    return;
+  }
+
+  while(list) {
+    struct cached_stack *next = list->next;
+    tbmunmap((char *)list - list->guard, list->size);
+    list = next;
+  }
+}
+
+void tb_desc_walk_begin()
+{
+  __atomic_add_fetch(&desc_walkers, 1, __ATOMIC_SEQ_CST);
+}
+
+void tb_desc_walk_end()
+{
+  if(!__atomic_sub_fetch(&desc_walkers, 1, __ATOMIC_SEQ_CST) &&
+     __atomic_load_n(&graveyard, __ATOMIC_ACQUIRE))
+    reap();
+}
+
+//------------------------------------------------------------------------------
+// Fault in a stack that comes from the cache, its pages may have been taken
+// away; touch them by hand if the kernel cannot populate them for us
+//------------------------------------------------------------------------------
+static void populate(char *start, uint32_t size)
+{
+  if(SYSCALL3(__NR_madvise, start, size, MADV_POPULATE_WRITE) == 0)
+    return;
+  for(uint32_t i = 0; i < size; i += EXEC_PAGESIZE)
+    __atomic_fetch_or(&start[i], 0, __ATOMIC_RELAXED);
+}
+
+//------------------------------------------------------------------------------
+// Get a stack from the cache or map a new one
+//------------------------------------------------------------------------------
+int tb_stack_get(void **stack, uint32_t size, uint32_t guard, int mode)
+{
+  tb_futex_lock(&stack_cache_lock);
+  for(struct cached_stack **cursor = &stack_cache; *cursor;
+      cursor = &(*cursor)->next) {
+    struct cached_stack *cached = *cursor;
+    if(cached->size != size || cached->guard != guard || cached->mode != mode)
+      continue;
+    *cursor = cached->next;
+    stack_cache_size -= size;
+    tb_futex_unlock(&stack_cache_lock);
+    *stack = (char *)cached - guard;
+    if(mode == TBTHREAD_STACK_POPULATE)
+      populate((char *)*stack + guard, size - guard);
+    return 0;
+  }
+  tb_futex_unlock(&stack_cache_lock);
+
+  //----------------------------------------------------------------------------
+  // Map a new stack with the guard at the end so that we could protect from
+  // overflows (by receiving a SIGSEGV). The lazy stacks are not accounted
+  // for as committed memory, so that lots of mostly idle threads may have
+  // big stacks; the populated ones are faulted in right away, so that
+  // latency-critical threads never take a page fault on their stacks.
+  //----------------------------------------------------------------------------
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  if(mode == TBTHREAD_STACK_NORESERVE)
+    flags |= MAP_NORESERVE;
+  else if(mode == TBTHREAD_STACK_POPULATE)
+    flags |= MAP_POPULATE;
+
+  void *mem = tbmmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  long status = (long)mem;
+  if(status < 0)
+    return status;
+
+  if(guard) {
+    status = SYSCALL3(__NR_mprotect, mem, guard, PROT_NONE);
+    if(status < 0) {
+      tbmunmap(mem, size);
+      return status;
+    }
+  }
+  *stack = mem;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Put the stack of a thread that has exited in the cache, or unmap it if the
+// cache is full
+//------------------------------------------------------------------------------
+void tb_stack_put(void *stack, uint32_t size, uint32_t guard, int mode)
+{
+  struct cached_stack *cached = (void *)((char *)stack + guard);
+  cached->size = size;
+  cached->guard = guard;
+  cached->mode = mode;
+
+  tb_futex_lock(&stack_cache_lock);
+  int fits = stack_cache_size + size <= STACK_CACHE_MAX;
+  if(fits)
+    stack_cache_size += size;
+  tb_futex_unlock(&stack_cache_lock);
+
+  if(!fits) {
+    bury(cached, cached);
+    reap();
+    return;
+  }
+
+  //----------------------------------------------------------------------------
+  // Leave out the page holding the list node
+  //----------------------------------------------------------------------------
+  if(size > guard + EXEC_PAGESIZE)
+    SYSCALL3(__NR_madvise, (char *)cached + EXEC_PAGESIZE,
+             size - guard - EXEC_PAGESIZE, MADV_FREE);
+
+  tb_futex_lock(&stack_cache_lock);
+  cached->next = stack_cache;
+  stack_cache = cached;
+  tb_futex_unlock(&stack_cache_lock);
+}
+
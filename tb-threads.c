@@ -33,9 +33,12 @@
 //------------------------------------------------------------------------------
 // Prototypes and globals
 //------------------------------------------------------------------------------
-static void release_descriptor(tbthread_t desc);
-static struct tbthread *get_descriptor();
-tbthread_mutex_t desc_mutex = TBTHREAD_MUTEX_INITIALIZER;
+static void release_descriptor(struct tbthread *desc);
+static struct tbthread *get_main_descriptor();
+static void forget_descriptor(struct tbthread *desc);
+static void free_descriptor(struct tbthread *desc);
+static void push_exited(struct tbthread *first, struct tbthread *last);
+static void reap_exited();
 int tb_pid = 0;
 
 //------------------------------------------------------------------------------
@@ -44,20 +47,23 @@ int tb_pid = 0;
 static void *glibc_thread_desc;
 void tbthread_init()
 {
-  glibc_thread_desc = tbthread_self();
-  tbthread_t thread = malloc(sizeof(struct tbthread));
-  memset(thread, 0, sizeof(struct tbthread));
-  thread->self = thread;
+  glibc_thread_desc = tb_self();
+  struct tbthread *thread = get_main_descriptor();
   thread->sched_info = SCHED_INFO_PACK(SCHED_NORMAL, 0);
+  thread->user_sched_info = thread->sched_info;
   SYSCALL2(__NR_arch_prctl, ARCH_SET_FS, thread);
   tb_pid = SYSCALL0(__NR_getpid);
   thread->tid = tb_pid;
+  tb_barrier_init();
 
   struct sigaction sa;
   memset(&sa, 0, sizeof(struct sigaction));
   sa.sa_handler = (__sighandler_t)tb_cancel_handler;
   sa.sa_flags = SA_SIGINFO;
   tbsigaction(SIGCANCEL, &sa, 0);
+
+  tb_lockstat_name(&memory_lock, "memory_lock");
+  tb_lockstat_name(&print_lock, "print_lock");
 }
 
 //------------------------------------------------------------------------------
@@ -65,7 +71,13 @@ void tbthread_init()
 //------------------------------------------------------------------------------
 void tbthread_finit()
 {
-  free(tbthread_self());
+  reap_exited();
+  tb_hazard_thread_exit();
+  struct tbthread *self = tb_self();
+  forget_descriptor(self);
+  release_descriptor(self);
+  tb_tls_free_blocks(self);
+  free_descriptor(self);
   SYSCALL2(__NR_arch_prctl, ARCH_SET_FS, glibc_thread_desc);
 }
 
@@ -76,6 +88,7 @@ void tbthread_attr_init(tbthread_attr_t *attr)
 {
   memset(attr, 0, sizeof(tbthread_attr_t));
   attr->stack_size = 8192 * 1024;
+  attr->guard_size = EXEC_PAGESIZE;
   attr->joinable   = 1;
   attr->sched_inherit = TBTHREAD_INHERIT_SCHED;
 }
@@ -88,12 +101,56 @@ int tbthread_attr_setdetachstate(tbthread_attr_t *attr, int state)
     attr->joinable = 1;
 }
 
+//------------------------------------------------------------------------------
+// Stack attributes. The sizes are rounded up to whole pages and the guard
+// goes below the stack, so it does not eat into the requested size. The
+// stacks supplied by the user get no guard and no special mode, and the
+// memory needs to stay around until the thread is joined.
+//------------------------------------------------------------------------------
+#define PAGE_ROUND_UP(size) (((size) + EXEC_PAGESIZE - 1) & ~(EXEC_PAGESIZE - 1))
+#define STACK_SIZE_MAX (UINT32_MAX / 2)
+
+int tbthread_attr_setstacksize(tbthread_attr_t *attr, size_t size)
+{
+  if(size < TBTHREAD_STACK_MIN || size > STACK_SIZE_MAX)
+    return -EINVAL;
+  attr->stack_size = PAGE_ROUND_UP(size);
+  attr->stack_addr = 0;
+  return 0;
+}
+
+int tbthread_attr_setguardsize(tbthread_attr_t *attr, size_t size)
+{
+  if(size > STACK_SIZE_MAX)
+    return -EINVAL;
+  attr->guard_size = PAGE_ROUND_UP(size);
+  return 0;
+}
+
+int tbthread_attr_setstack(tbthread_attr_t *attr, void *addr, size_t size)
+{
+  if(!addr || size < TBTHREAD_STACK_MIN || size > STACK_SIZE_MAX)
+    return -EINVAL;
+  attr->stack_addr = addr;
+  attr->stack_size = size;
+  return 0;
+}
+
+int tbthread_attr_setstackmode(tbthread_attr_t *attr, int mode)
+{
+  if(mode != TBTHREAD_STACK_DEFAULT && mode != TBTHREAD_STACK_NORESERVE &&
+     mode != TBTHREAD_STACK_POPULATE)
+    return -EINVAL;
+  attr->stack_mode = mode;
+  return 0;
+}
+
 //------------------------------------------------------------------------------
 // Thread function wrapper
 //------------------------------------------------------------------------------
 static int start_thread(void *arg)
 {
-  tbthread_t th = (tbthread_t)arg;
+  struct tbthread *th = arg;
 
   //----------------------------------------------------------------------------
   // Wait until we can run the user function
@@ -119,44 +176,36 @@ static int start_thread(void *arg)
 //------------------------------------------------------------------------------
 void tbthread_exit(void *retval)
 {
-  tbthread_t th = tbthread_self();
-  uint32_t stack_size = th->stack_size;
-  void *stack = th->stack;
-  int free_desc = 0;
-
+  struct tbthread *th = tb_self();
   th->retval = retval;
   tb_call_cleanup_handlers();
   tb_tls_call_destructors();
-
-  tbthread_mutex_lock(&desc_mutex);
-  if(th->join_status == TB_DETACHED)
-    free_desc = 1;
-  th->join_status = TB_JOINABLE_FIXED;
-  tbthread_mutex_unlock(&desc_mutex);
-
-  if(free_desc)
-    release_descriptor(th);
+  tb_rcu_thread_offline();
+  tb_hazard_thread_exit();
 
   //----------------------------------------------------------------------------
-  // Free the stack and exit. We do it this way because we remove the stack from
-  // underneath our feet and cannot allow the C code to write on it anymore.
+  // We cannot give away the stack we are running on, nor the descriptor that
+  // lives on top of it. They go back to the cache once the kernel clears the
+  // tid: when we're joined, or, if we're detached, when the list of exited
+  // threads is reaped next. The spare descriptor of a user stack stays with
+  // the slot, and the next thread taking the slot waits for the tid.
   //----------------------------------------------------------------------------
-  register long a1 asm("rdi") = (long)stack;
-  register long a2 asm("rsi") = stack_size;
-  asm volatile(
-    "syscall\n\t"
-    "movq $60, %%rax\n\t" // 60 = __NR_exit
-    "movq $0, %%rdi\n\t"
-    "syscall"
-    :
-    : "a" (__NR_munmap), "r" (a1), "r" (a2)
-    : "memory", "cc", "r11", "cx");
+  uint8_t status = __atomic_exchange_n(&th->join_status, TB_JOINABLE_FIXED,
+                                       __ATOMIC_ACQ_REL);
+  if(status == TB_DETACHED && th->user_stack)
+    release_descriptor(th);
+  else if(status == TB_DETACHED) {
+    forget_descriptor(th);
+    release_descriptor(th);
+    push_exited(th, th);
+  }
+  SYSCALL1(__NR_exit, 0);
 }
 
 //------------------------------------------------------------------------------
 // Wait for exit
 //------------------------------------------------------------------------------
-static void wait_for_thread(tbthread_t thread)
+static void wait_for_thread(struct tbthread *thread)
 {
   uint32_t tid = thread->tid;
   long ret = 0;
@@ -167,66 +216,339 @@ static void wait_for_thread(tbthread_t thread)
 }
 
 //------------------------------------------------------------------------------
-// Descriptor lists
+// The detached threads that have exited. They put their descriptors on a
+// lock-free list on the way out, and whoever creates, joins, or finalizes
+// next gives back the stacks of the ones that the kernel is done with, so
+// the stacks do not stay around until somebody takes the same slot.
+//------------------------------------------------------------------------------
+static struct tbthread *exited = 0;
+
+static void push_exited(struct tbthread *first, struct tbthread *last)
+{
+  struct tbthread *head;
+  do {
+    head = __atomic_load_n(&exited, __ATOMIC_ACQUIRE);
+    last->next_exited = head;
+  } while(!__sync_bool_compare_and_swap(&exited, head, first));
+}
+
+static void reap_exited()
+{
+  if(!__atomic_load_n(&exited, __ATOMIC_ACQUIRE))
+    return;
+
+  struct tbthread *list = __atomic_exchange_n(&exited, 0, __ATOMIC_ACQ_REL);
+  struct tbthread *first = 0, *last = 0;
+  while(list) {
+    struct tbthread *next = list->next_exited;
+    if(__atomic_load_n(&list->tid, __ATOMIC_ACQUIRE)) {
+      list->next_exited = first;
+      first = list;
+      if(!last)
+        last = list;
+    }
+    else
+      tb_stack_put(list->stack, list->stack_size, list->guard_size,
+                   list->stack_mode);
+    list = next;
+  }
+  if(first)
+    push_exited(first, last);
+}
+
+//------------------------------------------------------------------------------
+// The descriptor registry. The descriptors live in a table of slots that is
+// allocated in chunks as it grows and never shrinks, so a slot, once there,
+// stays where it is. A handle is the index of the slot and its generation.
+// The generation is bumped when a slot is taken and when it is released, so
+// it is odd while the slot is in use and a handle validates with a single
+// comparison. The free slots are kept on a lock-free stack with an ABA tag.
+// Most descriptors live on top of the stacks. A handle stays valid until its
+// thread is joined, or until it exits if it is detached; whoever may look at
+// the descriptor of a thread it does not hold a valid handle to, needs to
+// bracket the access with tb_desc_walk_begin and tb_desc_walk_end, so that
+// the stack does not get unmapped under its feet.
+//------------------------------------------------------------------------------
+#define SLOT_CHUNK_SIZE 1024
+#define SLOT_CHUNKS     1024
+#define SLOT_MAX        (SLOT_CHUNK_SIZE * SLOT_CHUNKS)
+
+#define HANDLE_INDEX(handle) ((uint32_t)(handle))
+#define HANDLE_GEN(handle)   ((uint32_t)((handle) >> 32))
+#define HANDLE(index, gen)   (((uint64_t)(gen) << 32) | (index))
+
+struct slot {
+  uint32_t         gen;
+  uint32_t         next_free;
+  struct tbthread *desc;
+  struct tbthread *spare;
+};
+
+static struct slot *slot_chunks[SLOT_CHUNKS];
+static uint32_t num_slots = 0;
+static uint64_t free_slots = 0;
+
+//------------------------------------------------------------------------------
+// Get a slot, or null if its chunk has not been allocated yet
 //------------------------------------------------------------------------------
-list_t used_desc;
-static list_t free_desc;
+static struct slot *get_slot(uint32_t index)
+{
+  struct slot *chunk = __atomic_load_n(&slot_chunks[index / SLOT_CHUNK_SIZE],
+                                       __ATOMIC_ACQUIRE);
+  if(!chunk)
+    return 0;
+  return &chunk[index % SLOT_CHUNK_SIZE];
+}
 
 //------------------------------------------------------------------------------
-// Get a descriptor
+// Take a slot that has never been used. The chunk is allocated before the
+// index is published, so that a failed allocation does not burn the index
+// and whoever walks the registry never finds a slot without a chunk.
 //------------------------------------------------------------------------------
-static struct tbthread *get_descriptor()
+static struct slot *new_slot(uint32_t *index)
 {
-  tbthread_t  desc = 0;
-  list_t     *node = 0;
+  while(1) {
+    uint32_t i = __atomic_load_n(&num_slots, __ATOMIC_ACQUIRE);
+    if(i >= SLOT_MAX)
+      return 0;
 
-  //----------------------------------------------------------------------------
-  // Try to re-use a thread descriptor and make sure that the corresponding
-  // thread has actually exited
-  //----------------------------------------------------------------------------
-  tbthread_mutex_lock(&desc_mutex);
-  node = free_desc.next;
-  if(node)
-    list_rm(node);
-  tbthread_mutex_unlock(&desc_mutex);
-
-  if(node) {
-    desc = (tbthread_t)node->element;
-    wait_for_thread(desc);
+    struct slot **chunk = &slot_chunks[i / SLOT_CHUNK_SIZE];
+    if(!__atomic_load_n(chunk, __ATOMIC_ACQUIRE)) {
+      struct slot *new_chunk = malloc(SLOT_CHUNK_SIZE * sizeof(struct slot));
+      if(!new_chunk)
+        return 0;
+      memset(new_chunk, 0, SLOT_CHUNK_SIZE * sizeof(struct slot));
+      if(!__sync_bool_compare_and_swap(chunk, 0, new_chunk))
+        free(new_chunk);
+    }
+
+    if(__sync_bool_compare_and_swap(&num_slots, i, i+1)) {
+      *index = i;
+      return get_slot(i);
+    }
   }
+}
 
-  //----------------------------------------------------------------------------
-  // We don't have any free descriptors so we allocate and add to the list of
-  // used descriptors
-  //----------------------------------------------------------------------------
-  if(!node) {
-    desc = malloc(sizeof(struct tbthread));
-    node = malloc(sizeof(list_t));
-    node->element = desc;
+//------------------------------------------------------------------------------
+// Pop and push the free slots; the stack head holds the index plus one in
+// the low half and the tag in the high half
+//------------------------------------------------------------------------------
+static struct slot *pop_free_slot(uint32_t *index)
+{
+  uint64_t head, new_head;
+  struct slot *slot;
+  do {
+    head = __atomic_load_n(&free_slots, __ATOMIC_ACQUIRE);
+    if(!(uint32_t)head)
+      return 0;
+    *index = (uint32_t)head - 1;
+    slot = get_slot(*index);
+    new_head = ((head >> 32) + 1) << 32 | slot->next_free;
+  } while(!__sync_bool_compare_and_swap(&free_slots, head, new_head));
+  return slot;
+}
+
+static void push_free_slot(struct slot *slot, uint32_t index)
+{
+  uint64_t head, new_head;
+  do {
+    head = __atomic_load_n(&free_slots, __ATOMIC_ACQUIRE);
+    slot->next_free = (uint32_t)head;
+    new_head = ((head >> 32) + 1) << 32 | (index + 1);
+  } while(!__sync_bool_compare_and_swap(&free_slots, head, new_head));
+}
+
+//------------------------------------------------------------------------------
+// Allocate and free the memory of the descriptors that do not live on a
+// stack of ours: the main thread's one and the spares. The descriptor is laid
+// out in cache lines, but our malloc aligns to 8 bytes only, so we align it
+// by hand and keep the original pointer in front of it.
+//------------------------------------------------------------------------------
+static struct tbthread *alloc_descriptor()
+{
+  void *mem = malloc(sizeof(struct tbthread) + 64);
+  if(!mem)
+    return 0;
+  struct tbthread *desc = (void *)(((uint64_t)mem + 64) & ~63ULL);
+  ((void **)desc)[-1] = mem;
+  return desc;
+}
+
+static void free_descriptor(struct tbthread *desc)
+{
+  free(((void **)desc)[-1]);
+}
+
+//------------------------------------------------------------------------------
+// Take a slot for a new thread. A slot released by a detached thread that ran
+// on a user stack still points to the spare descriptor of that thread, so we
+// need to make sure that the thread has actually exited before the spare is
+// used again.
+//------------------------------------------------------------------------------
+static struct slot *take_slot(uint32_t *index)
+{
+  struct slot *slot = pop_free_slot(index);
+  if(!slot)
+    return new_slot(index);
+
+  struct tbthread *desc = slot->desc;
+  if(desc) {
+    wait_for_thread(desc);
+    slot->desc = 0;
   }
+  return slot;
+}
 
-  tbthread_mutex_lock(&desc_mutex);
+//------------------------------------------------------------------------------
+// Put a fresh descriptor in a slot and make the slot live
+//------------------------------------------------------------------------------
+static void install_descriptor(struct slot *slot, uint32_t index,
+  struct tbthread *desc)
+{
+  memset(desc, 0, sizeof(struct tbthread));
+  desc->self = desc;
+  desc->handle = HANDLE(index, slot->gen + 1);
+  __atomic_store_n(&slot->desc, desc, __ATOMIC_RELEASE);
+  __atomic_store_n(&slot->gen, slot->gen + 1, __ATOMIC_RELEASE);
+}
 
-  list_add(&used_desc, node, 0);
-  tbthread_mutex_unlock(&desc_mutex);
+//------------------------------------------------------------------------------
+// Get a descriptor for the main thread
+//------------------------------------------------------------------------------
+static struct tbthread *get_main_descriptor()
+{
+  uint32_t index;
+  struct slot *slot = take_slot(&index);
+  if(!slot)
+    return 0;
+
+  struct tbthread *desc = alloc_descriptor();
+  if(!desc) {
+    push_free_slot(slot, index);
+    return 0;
+  }
+  install_descriptor(slot, index, desc);
   return desc;
 }
 
 //------------------------------------------------------------------------------
-// Release a descriptor
+// Get a descriptor and a stack for a new thread. Like glibc, we carve the
+// descriptor from the top of the stack, so that one allocation gets us both
+// and they end up close to each other in memory. The user may free the stack
+// it has supplied as soon as the thread is joined, while the others may still
+// look at the descriptor, so such a thread gets the spare descriptor of its
+// slot instead. The spare is allocated on first use and never freed.
 //------------------------------------------------------------------------------
-static void release_descriptor(tbthread_t desc)
+static int get_descriptor(struct tbthread **desc, const tbthread_attr_t *attr)
 {
-  tbthread_mutex_lock(&desc_mutex);
-  list_t *node = list_find_elem(&used_desc, desc);
-  if(!node) {
-    tbprint("Releasing unknown descriptor: 0x%llx! Scared and confused!\n",
-            desc);
-    // abort!
+  reap_exited();
+  uint32_t index;
+  struct slot *slot = take_slot(&index);
+  if(!slot)
+    return -EAGAIN;
+
+  void *stack = attr->stack_addr;
+  uint32_t stack_size = attr->stack_size;
+  uint32_t guard_size = 0;
+  if(!stack) {
+    guard_size = attr->guard_size;
+    stack_size += guard_size;
+    int ret = tb_stack_get(&stack, stack_size, guard_size, attr->stack_mode);
+    if(ret) {
+      push_free_slot(slot, index);
+      return ret;
+    }
+  }
+
+  if(attr->stack_addr) {
+    if(!slot->spare && !(slot->spare = alloc_descriptor())) {
+      push_free_slot(slot, index);
+      return -ENOMEM;
+    }
+    *desc = slot->spare;
+  }
+  else {
+    uint64_t top = (uint64_t)stack + stack_size;
+    *desc = (void *)((top - sizeof(struct tbthread)) & ~63ULL);
   }
-  list_rm(node);
-  list_add(&free_desc, node, 0);
-  tbthread_mutex_unlock(&desc_mutex);
+  install_descriptor(slot, index, *desc);
+  (*desc)->stack = stack;
+  (*desc)->stack_size = stack_size;
+  (*desc)->guard_size = guard_size;
+  (*desc)->stack_mode = attr->stack_mode;
+  (*desc)->user_stack = attr->stack_addr != 0;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Release a descriptor
+//------------------------------------------------------------------------------
+static void release_descriptor(struct tbthread *desc)
+{
+  uint32_t index = HANDLE_INDEX(desc->handle);
+  struct slot *slot = get_slot(index);
+  __atomic_store_n(&slot->gen, slot->gen + 1, __ATOMIC_RELEASE);
+  push_free_slot(slot, index);
+}
+
+//------------------------------------------------------------------------------
+// Make the slot forget the descriptor, so that it can be freed
+//------------------------------------------------------------------------------
+static void forget_descriptor(struct tbthread *desc)
+{
+  __atomic_store_n(&get_slot(HANDLE_INDEX(desc->handle))->desc, 0,
+                   __ATOMIC_RELEASE);
+}
+
+//------------------------------------------------------------------------------
+// Drop the descriptor of a thread that is gone and give its stack back. The
+// slot needs to forget the descriptor first, because the stack, and the
+// descriptor with it, may go to another slot as soon as it is in the cache.
+//------------------------------------------------------------------------------
+static void drop_descriptor(struct tbthread *desc)
+{
+  void *stack = desc->stack;
+  uint32_t stack_size = desc->stack_size;
+  uint32_t guard_size = desc->guard_size;
+  int stack_mode = desc->stack_mode;
+  int user_stack = desc->user_stack;
+  forget_descriptor(desc);
+  release_descriptor(desc);
+  if(!user_stack)
+    tb_stack_put(stack, stack_size, guard_size, stack_mode);
+}
+
+//------------------------------------------------------------------------------
+// Find the descriptor of a handle if the handle is still valid
+//------------------------------------------------------------------------------
+struct tbthread *tb_desc_lookup(tbthread_t handle)
+{
+  uint32_t gen = HANDLE_GEN(handle);
+  uint32_t index = HANDLE_INDEX(handle);
+  if(!(gen & 1) || index >= SLOT_MAX)
+    return 0;
+
+  struct slot *slot = get_slot(index);
+  if(!slot || __atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE) != gen)
+    return 0;
+  return __atomic_load_n(&slot->desc, __ATOMIC_ACQUIRE);
+}
+
+//------------------------------------------------------------------------------
+// Walk the registry: the number of slots that may be in use, and the
+// descriptor of a slot if it is in use
+//------------------------------------------------------------------------------
+uint32_t tb_desc_num_slots()
+{
+  return __atomic_load_n(&num_slots, __ATOMIC_ACQUIRE);
+}
+
+struct tbthread *tb_desc_get(uint32_t index)
+{
+  struct slot *slot = get_slot(index);
+  if(!slot || !(__atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE) & 1))
+    return 0;
+  return __atomic_load_n(&slot->desc, __ATOMIC_ACQUIRE);
 }
 
 //------------------------------------------------------------------------------
@@ -241,34 +563,18 @@ int tbthread_create(
   int ret = 0;
   *thread = 0;
 
-  //----------------------------------------------------------------------------
-  // Allocate the stack with a guard page at the end so that we could protect
-  // from overflows (by receiving a SIGSEGV)
-  //----------------------------------------------------------------------------
-  void *stack = tbmmap(NULL, attr->stack_size, PROT_READ | PROT_WRITE,
-                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  long status = (long)stack;
-  if(status < 0)
-    return status;
-
-  status = SYSCALL3(__NR_mprotect, stack, EXEC_PAGESIZE, PROT_NONE);
-  if(status < 0) {
-    ret = status;
-    goto error;
-  }
-
   //----------------------------------------------------------------------------
   // Pack everything up
   //----------------------------------------------------------------------------
-  *thread = get_descriptor();
-  memset(*thread, 0, sizeof(struct tbthread));
-  (*thread)->self = *thread;
-  (*thread)->stack = stack;
-  (*thread)->stack_size = attr->stack_size;
-  (*thread)->fn = f;
-  (*thread)->arg = arg;
-  (*thread)->join_status = attr->joinable;
-  (*thread)->cancel_status = TB_CANCEL_ENABLED | TB_CANCEL_DEFERRED;
+  struct tbthread *desc;
+  ret = get_descriptor(&desc, attr);
+  if(ret)
+    return ret;
+
+  desc->fn = f;
+  desc->arg = arg;
+  desc->join_status = attr->joinable;
+  desc->cancel_status = TB_CANCEL_ENABLED | TB_CANCEL_DEFERRED;
 
   //----------------------------------------------------------------------------
   // If we set a scheduling policy, we need to make sure that the thread goes to
@@ -276,10 +582,11 @@ int tbthread_create(
   // successfuly set the before the user function executes.
   //----------------------------------------------------------------------------
   if(!attr->sched_inherit)
-    (*thread)->start_status = TB_START_WAIT;
+    desc->start_status = TB_START_WAIT;
   else {
-    tbthread_t self = tbthread_self();
-    (*thread)->sched_info = self->sched_info;
+    struct tbthread *self = tb_self();
+    desc->sched_info = self->sched_info;
+    desc->user_sched_info = self->user_sched_info;
   }
 
   //----------------------------------------------------------------------------
@@ -287,125 +594,135 @@ int tbthread_create(
   //----------------------------------------------------------------------------
   int flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SYSVSEM | CLONE_SIGHAND;
   flags |= CLONE_THREAD | CLONE_SETTLS;
-  flags |= CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID;
+  flags |= CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID;
 
-  int tid = tbclone(start_thread, *thread, flags, stack+attr->stack_size,
-                    0, &(*thread)->tid, *thread);
+  //----------------------------------------------------------------------------
+  // The kernel stores the tid before the thread gets to run. Storing it
+  // ourselves after the clone returns could overwrite the zero that the
+  // kernel leaves there when a short-lived thread is already gone. The
+  // stack of the thread ends where its descriptor begins, unless the user
+  // has supplied it.
+  //----------------------------------------------------------------------------
+  void *stack_top = desc;
+  if(desc->user_stack)
+    stack_top = (void *)(((uint64_t)desc->stack + desc->stack_size) & ~15ULL);
+  int tid = tbclone(start_thread, desc, flags, stack_top,
+                    &desc->tid, &desc->tid, desc);
   if(tid < 0) {
     ret = tid;
     goto error;
   }
 
-  //----------------------------------------------------------------------------
-  // It may happen that we will start to wait for this futex before the kernel
-  // manages to fill it with something meaningful.
-  //----------------------------------------------------------------------------
-  (*thread)->tid = tid;
-
   //----------------------------------------------------------------------------
   // Set scheduling policy. If we succeed, we let the thread run. If not, we
   // wait for it to exit;
   //----------------------------------------------------------------------------
   if(!attr->sched_inherit) {
-    ret = tb_set_sched(*thread, attr->sched_policy, attr->sched_priority);
+    ret = tb_set_sched(desc, attr->sched_policy, attr->sched_priority);
+    desc->user_sched_info = desc->sched_info;
 
-    if(ret) (*thread)->start_status = TB_START_EXIT;
-    else (*thread)->start_status = TB_START_OK;
-    SYSCALL3(__NR_futex, &(*thread)->start_status, FUTEX_WAKE, 1);
+    if(ret) desc->start_status = TB_START_EXIT;
+    else desc->start_status = TB_START_OK;
+    SYSCALL3(__NR_futex, &desc->start_status, FUTEX_WAKE, 1);
 
     if(ret) {
-      wait_for_thread(*thread);
+      wait_for_thread(desc);
       goto error;
     }
   }
+  *thread = desc->handle;
   return 0;
 
 error:
-  tbmunmap(stack, attr->stack_size);
-  release_descriptor(*thread);
+  drop_descriptor(desc);
   return ret;
 }
 
 //------------------------------------------------------------------------------
 // Detach a thread
 //------------------------------------------------------------------------------
-int tbthread_detach(tbthread_t thread)
+int tbthread_detach(tbthread_t handle)
 {
-  int ret = 0;
-
-  tbthread_mutex_lock(&desc_mutex);
-  if(!list_find_elem(&used_desc, thread)) {
-    ret = -ESRCH;
-    goto exit;
-  }
-
-  if(thread->join_status == TB_JOINABLE_FIXED) {
-    ret = -EINVAL;
-    goto exit;
-  }
-
-  thread->join_status = TB_DETACHED;
-exit:
-  tbthread_mutex_unlock(&desc_mutex);
-  return ret;
+  struct tbthread *thread = tb_desc_lookup(handle);
+  if(!thread)
+    return -ESRCH;
+
+  uint8_t status;
+  do {
+    status = thread->join_status;
+    if(status == TB_JOINABLE_FIXED)
+      return -EINVAL;
+  } while(!__sync_bool_compare_and_swap(&thread->join_status, status,
+                                        TB_DETACHED));
+  return 0;
 }
 
 //------------------------------------------------------------------------------
 // Join a thread
 //------------------------------------------------------------------------------
-int tbthread_join(tbthread_t thread, void **retval)
+int tbthread_join(tbthread_t handle, void **retval)
 {
-  tbthread_t self = tbthread_self();
-  int ret = 0;
+  struct tbthread *self = tb_self();
 
   //----------------------------------------------------------------------------
   // Check if the thread may be joined
   //----------------------------------------------------------------------------
-  tbthread_mutex_lock(&desc_mutex);
+  if(handle == self->handle)
+    return -EDEADLK;
 
-  if(thread == self) {
-    ret = -EDEADLK;
-    goto error;
-  }
+  struct tbthread *thread = tb_desc_lookup(handle);
+  if(!thread)
+    return -ESRCH;
 
-  if(!list_find_elem(&used_desc, thread)) {
-    ret = -ESRCH;
-    goto error;
-  }
+  if(thread->join_status == TB_DETACHED)
+    return -EINVAL;
 
-  if(thread->join_status == TB_DETACHED) {
-    ret = -EINVAL;
-    goto error;
-  }
+  if(self->joiner == thread)
+    return -EDEADLK;
 
-  if(self->joiner == thread) {
-    ret = -EDEADLK;
-    goto error;
-  }
+  //----------------------------------------------------------------------------
+  // Become the joiner and make sure that the handle has not gone stale in the
+  // meantime
+  //----------------------------------------------------------------------------
+  if(!__sync_bool_compare_and_swap(&thread->joiner, 0, self))
+    return -EINVAL;
 
-  if(thread->joiner) {
-    ret = -EINVAL;
-    goto error;
+  if(tb_desc_lookup(handle) != thread) {
+    __sync_bool_compare_and_swap(&thread->joiner, self, 0);
+    return -ESRCH;
   }
 
-  thread->join_status = TB_JOINABLE_FIXED;
-  thread->joiner = self;
+  uint8_t status;
+  do {
+    status = thread->join_status;
+    if(status == TB_DETACHED) {
+      __sync_bool_compare_and_swap(&thread->joiner, self, 0);
+      return -EINVAL;
+    }
+  } while(!__sync_bool_compare_and_swap(&thread->join_status, status,
+                                        TB_JOINABLE_FIXED));
 
   //----------------------------------------------------------------------------
-  // We can release the lock now, because we're responsible for releasing the
-  // thread descriptor now, so it's not going to go away.
+  // We're responsible for releasing the thread descriptor now, so it's not
+  // going to go away.
   //----------------------------------------------------------------------------
-  tbthread_mutex_unlock(&desc_mutex);
-
   wait_for_thread(thread);
   if(retval)
     *retval = thread->retval;
-  release_descriptor(thread);
+  drop_descriptor(thread);
+  reap_exited();
   return 0;
+}
 
-error:
-  tbthread_mutex_unlock(&desc_mutex);
-  return ret;
+//------------------------------------------------------------------------------
+// Get the kernel thread id
+//------------------------------------------------------------------------------
+int tbthread_gettid(tbthread_t handle)
+{
+  struct tbthread *thread = tb_desc_lookup(handle);
+  if(!thread)
+    return -ESRCH;
+  return thread->tid;
 }
 
 //------------------------------------------------------------------------------
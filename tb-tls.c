@@ -18,17 +18,26 @@
 //------------------------------------------------------------------------------
 
 #include "tb.h"
+#include "tb-private.h"
 
 //------------------------------------------------------------------------------
-// Get the pointer of the currently running thread
+// Get the descriptor of the currently running thread
 //------------------------------------------------------------------------------
-tbthread_t tbthread_self()
+struct tbthread *tb_self()
 {
-  tbthread_t self;
+  struct tbthread *self;
   asm("movq %%fs:0, %0\n\t" : "=r" (self));
   return self;
 }
 
+//------------------------------------------------------------------------------
+// Get the handle of the currently running thread
+//------------------------------------------------------------------------------
+tbthread_t tbthread_self()
+{
+  return tb_self()->handle;
+}
+
 //------------------------------------------------------------------------------
 // The keys and helpers
 //------------------------------------------------------------------------------
@@ -71,6 +80,27 @@ int tbthread_key_delete(tbthread_key_t key)
   return -EINVAL;
 }
 
+//------------------------------------------------------------------------------
+// Find the entry of a key in the current thread, allocate its block if asked
+// to and if need be
+//------------------------------------------------------------------------------
+static struct tb_tls_entry *get_entry(struct tbthread *thread,
+  tbthread_key_t key, int alloc)
+{
+  if(key < TB_TLS_BLOCK_SIZE)
+    return &thread->tls[key];
+
+  struct tb_tls_entry **block = &thread->tls_blocks[key/TB_TLS_BLOCK_SIZE-1];
+  if(!*block) {
+    if(!alloc)
+      return 0;
+    *block = calloc(TB_TLS_BLOCK_SIZE, sizeof(struct tb_tls_entry));
+    if(!*block)
+      return 0;
+  }
+  return &(*block)[key % TB_TLS_BLOCK_SIZE];
+}
+
 //------------------------------------------------------------------------------
 // Get the thread specific data associated with the key
 //------------------------------------------------------------------------------
@@ -79,23 +109,26 @@ void *tbthread_getspecific(tbthread_key_t key)
   if(key >= TBTHREAD_MAX_KEYS || KEY_UNUSED(key))
     return 0;
 
-  tbthread_t self = tbthread_self();
-  if(self->tls[key].seq == keys[key].seq)
-    return self->tls[key].data;
+  struct tb_tls_entry *entry = get_entry(tb_self(), key, 0);
+  if(entry && entry->seq == keys[key].seq)
+    return entry->data;
   return 0;
 }
 
 //------------------------------------------------------------------------------
-// Associate thread specific data with the key
+// Associate thread specific data with the key; setting a null value does not
+// need a block
 //------------------------------------------------------------------------------
 int tbthread_setspecific(tbthread_key_t key, void *value)
 {
   if(key >= TBTHREAD_MAX_KEYS || KEY_UNUSED(key))
     return -EINVAL;
 
-  tbthread_t self = tbthread_self();
-  self->tls[key].seq = keys[key].seq;
-  self->tls[key].data = value;
+  struct tb_tls_entry *entry = get_entry(tb_self(), key, value != 0);
+  if(!entry)
+    return value ? -ENOMEM : 0;
+  entry->seq = keys[key].seq;
+  entry->data = value;
   return 0;
 }
 
@@ -104,13 +137,31 @@ int tbthread_setspecific(tbthread_key_t key, void *value)
 //------------------------------------------------------------------------------
 void tb_tls_call_destructors()
 {
-  tbthread_t self = tbthread_self();
+  struct tbthread *self = tb_self();
   for(tbthread_key_t i = 0; i < TBTHREAD_MAX_KEYS; ++i) {
-    if(!KEY_UNUSED(i) && self->tls[i].seq == keys[i].seq &&
-       self->tls[i].data && keys[i].destructor) {
-       void *data = self->tls[i].data;
-       self->tls[i].data = 0;
-       keys[i].destructor(data);
-     }
-   }
+    struct tb_tls_entry *entry = get_entry(self, i, 0);
+    if(!entry) {
+      i += TB_TLS_BLOCK_SIZE - 1;
+      continue;
+    }
+    if(!KEY_UNUSED(i) && entry->seq == keys[i].seq &&
+       entry->data && keys[i].destructor) {
+      void *data = entry->data;
+      entry->data = 0;
+      keys[i].destructor(data);
+    }
+  }
+  tb_tls_free_blocks(self);
+}
+
+//------------------------------------------------------------------------------
+// Free the second level blocks; the descriptors get recycled and the pointers
+// would be lost otherwise
+//------------------------------------------------------------------------------
+void tb_tls_free_blocks(struct tbthread *thread)
+{
+  for(int i = 0; i < TB_TLS_BLOCKS-1; ++i) {
+    free(thread->tls_blocks[i]);
+    thread->tls_blocks[i] = 0;
+  }
 }
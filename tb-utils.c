@@ -21,6 +21,8 @@
 #include "tb-private.h"
 
 #include <linux/time.h>
+#include <linux/membarrier.h>
+#include <linux/mman.h>
 #include <asm-generic/param.h>
 #include <string.h>
 #include <stdarg.h>
@@ -77,7 +79,7 @@ static void printNumS(int64_t num)
 //------------------------------------------------------------------------------
 // Print something to stdout
 //------------------------------------------------------------------------------
-static int print_lock;
+int print_lock;
 void tbprint(const char *format, ...)
 {
   tb_futex_lock(&print_lock);
@@ -179,6 +181,69 @@ uint64_t tbtime()
   return SYSCALL1(__NR_time, 0);
 }
 
+//------------------------------------------------------------------------------
+// Monotonic time in nanoseconds
+//------------------------------------------------------------------------------
+uint64_t tbtime_ns()
+{
+  struct timespec ts;
+  SYSCALL2(__NR_clock_gettime, CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//------------------------------------------------------------------------------
+// Asymmetric memory barriers. The heavy barrier forces a full memory barrier
+// on all the threads of the process, so that the other side can get away
+// with a compiler barrier. We prefer the private expedited membarrier, fall
+// back to the global one, and if the kernel has no membarrier at all, we
+// change the protection of a page that we have just touched. The latter
+// makes the kernel send TLB shootdown IPIs to all the CPUs running our
+// threads, which serializes them.
+//------------------------------------------------------------------------------
+#define BARRIER_PRIVATE 0
+#define BARRIER_GLOBAL  1
+#define BARRIER_MPROTECT 2
+
+static int barrier_type = BARRIER_MPROTECT;
+static int barrier_lock = 0;
+static int *barrier_page = 0;
+
+void tb_barrier_init()
+{
+  long cmds = SYSCALL2(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+  if(cmds > 0 && (cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+     SYSCALL2(__NR_membarrier,
+              MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) {
+    barrier_type = BARRIER_PRIVATE;
+    return;
+  }
+
+  if(cmds > 0 && (cmds & MEMBARRIER_CMD_GLOBAL)) {
+    barrier_type = BARRIER_GLOBAL;
+    return;
+  }
+
+  barrier_type = BARRIER_MPROTECT;
+  barrier_page = tbmmap(NULL, EXEC_PAGESIZE, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+void tb_heavy_barrier()
+{
+  if(barrier_type == BARRIER_PRIVATE)
+    SYSCALL2(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+  else if(barrier_type == BARRIER_GLOBAL)
+    SYSCALL2(__NR_membarrier, MEMBARRIER_CMD_GLOBAL, 0);
+  else {
+    tb_futex_lock(&barrier_lock);
+    SYSCALL3(__NR_mprotect, barrier_page, EXEC_PAGESIZE,
+             PROT_READ | PROT_WRITE);
+    __sync_fetch_and_add(barrier_page, 1);
+    SYSCALL3(__NR_mprotect, barrier_page, EXEC_PAGESIZE, PROT_NONE);
+    tb_futex_unlock(&barrier_lock);
+  }
+}
+
 //------------------------------------------------------------------------------
 // Random
 //------------------------------------------------------------------------------
@@ -229,7 +294,7 @@ static void       *heap_limit;
 //------------------------------------------------------------------------------
 // Malloc
 //------------------------------------------------------------------------------
-static int memory_lock;
+int memory_lock;
 void *malloc(size_t size)
 {
   tb_futex_lock(&memory_lock);
@@ -0,0 +1,157 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <linux/time.h>
+
+//------------------------------------------------------------------------------
+// Waiting for any of a bunch of primitives. Each primitive is armed: either
+// it is ready and we are done, or it tells us which futex word to sleep on and
+// what value it needs to hold. We then sleep on all of them at once with
+// futex_waitv. The kernels that do not have it get a single notification
+// futex instead; the primitives bump it whenever they wake anybody up while
+// somebody waits this way. The semaphores are waited on as if for a batch,
+// because we may take a unit from a different semaphore than the one that
+// woke us up, so the posts need to wake everybody. The latches and
+// wait-groups stay marked as waited on after a timeout, until their counts
+// drop to zero.
+//------------------------------------------------------------------------------
+#ifndef __NR_futex_waitv
+#define __NR_futex_waitv 449
+#endif
+
+#define WAITV_MAX 128
+#define WAITV_32  0x02
+
+struct waitv {
+  uint64_t val;
+  uint64_t uaddr;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+static int waitv_supported = -1;
+static int notify_seq = 0;
+static uint32_t notify_sleepers = 0;
+
+//------------------------------------------------------------------------------
+// Wake up everybody sleeping on the notification futex
+//------------------------------------------------------------------------------
+void tb_waitany_notify()
+{
+  if(!__atomic_load_n(&notify_sleepers, __ATOMIC_ACQUIRE))
+    return;
+  __sync_fetch_and_add(&notify_seq, 1);
+  SYSCALL3(__NR_futex, &notify_seq, FUTEX_WAKE, INT_MAX);
+}
+
+//------------------------------------------------------------------------------
+// Arm the item, return 1 if it is ready
+//------------------------------------------------------------------------------
+static int arm(tb_wait_item_t *item, uint32_t gen, struct waitv *wv)
+{
+  int *futex = 0;
+  uint32_t expected = 0;
+  int ready = 0;
+
+  if(item->type == TBTHREAD_WAIT_SEM)
+    ready = tb_sem_arm(item->object, &futex, &expected);
+  else {
+    futex = item->object;
+    ready = tb_count_arm(item->object, gen, &expected);
+  }
+
+  wv->val = expected;
+  wv->uaddr = (uint64_t)futex;
+  wv->flags = WAITV_32;
+  wv->reserved = 0;
+  return ready;
+}
+
+//------------------------------------------------------------------------------
+// Wait until one of the items is ready and return its index; take a unit if
+// it is a semaphore. Wait until the absolute CLOCK_REALTIME timeout if not
+// null.
+//------------------------------------------------------------------------------
+int tb_wait_any(tb_wait_item_t *items, int num, const struct timespec *abstime)
+{
+  struct waitv wv[WAITV_MAX];
+  uint32_t     gen[WAITV_MAX];
+  int          ready = -1;
+
+  if(num <= 0 || num > WAITV_MAX)
+    return -EINVAL;
+
+  for(int i = 0; i < num; ++i) {
+    if(items[i].type != TBTHREAD_WAIT_SEM &&
+       items[i].type != TBTHREAD_WAIT_LATCH &&
+       items[i].type != TBTHREAD_WAIT_WAITGROUP)
+      return -EINVAL;
+    gen[i] = 0;
+    if(items[i].type != TBTHREAD_WAIT_SEM)
+      gen[i] = tb_count_gen(items[i].object);
+  }
+
+  if(waitv_supported == -1)
+    waitv_supported =
+      SYSCALL5(__NR_futex_waitv, 0, 0, 0, 0, 0) != -ENOSYS;
+
+  //----------------------------------------------------------------------------
+  // Register with the semaphores and with the notification futex if need be
+  //----------------------------------------------------------------------------
+  for(int i = 0; i < num; ++i)
+    if(items[i].type == TBTHREAD_WAIT_SEM)
+      tb_sem_register(items[i].object);
+
+  if(!waitv_supported)
+    __sync_fetch_and_add(&notify_sleepers, 1);
+
+  while(1) {
+    int seq = __atomic_load_n(&notify_seq, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < num && ready == -1; ++i)
+      if(arm(&items[i], gen[i], &wv[i]))
+        ready = i;
+    if(ready != -1)
+      break;
+
+    long st;
+    if(waitv_supported)
+      st = SYSCALL5(__NR_futex_waitv, wv, num, 0, abstime, CLOCK_REALTIME);
+    else
+      st = SYSCALL6(__NR_futex, &notify_seq,
+                    FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME, seq,
+                    abstime, 0, FUTEX_BITSET_MATCH_ANY);
+    if(st == -ETIMEDOUT) {
+      ready = -ETIMEDOUT;
+      break;
+    }
+  }
+
+  if(!waitv_supported)
+    __sync_fetch_and_sub(&notify_sleepers, 1);
+
+  for(int i = 0; i < num; ++i)
+    if(items[i].type == TBTHREAD_WAIT_SEM)
+      tb_sem_unregister(items[i].object);
+  return ready;
+}
@@ -0,0 +1,206 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+
+//------------------------------------------------------------------------------
+// The parking lot. Threads may park on any address and the locks and other
+// primitives built on top of it need no waiter bookkeeping of their own. The
+// queues live in a static table of buckets hashed by the address. Each waiter
+// has a node on its own stack and sleeps on a private futex word within it.
+// The nodes are sorted by the effective priority of the waiter, FIFO within a
+// priority, because the kernel decides on its own in what order the futex
+// waiters are woken up. Each bucket counts its waiters, so that waking up
+// nobody costs a single load.
+//------------------------------------------------------------------------------
+#define WAITQ_BUCKETS 256
+
+struct waiter {
+  void          *addr;
+  int            futex;
+  uint8_t        priority;
+  struct waiter *next;
+};
+
+struct bucket {
+  int            lock;
+  uint32_t       num_waiters;
+  struct waiter *head;
+} __attribute__((aligned(64)));
+
+static struct bucket buckets[WAITQ_BUCKETS];
+
+//------------------------------------------------------------------------------
+// Find the bucket
+//------------------------------------------------------------------------------
+static struct bucket *get_bucket(void *addr)
+{
+  uint64_t hash = (uint64_t)addr * 0x9e3779b97f4a7c15ULL;
+  return &buckets[hash >> 56];
+}
+
+//------------------------------------------------------------------------------
+// Park on the address if validate says so; validate is called with the
+// bucket locked, so it cannot race with tb_unpark callbacks
+//------------------------------------------------------------------------------
+int tb_park(void *addr, int (*validate)(void *), void *arg)
+{
+  struct bucket *b = get_bucket(addr);
+  struct waiter node;
+  node.addr = addr;
+  node.futex = 0;
+  node.priority = 0;
+
+  struct tbthread *self = tb_self();
+  if(SCHED_INFO_POLICY(self->sched_info) != SCHED_NORMAL)
+    node.priority = SCHED_INFO_PRIORITY(self->sched_info);
+
+  //----------------------------------------------------------------------------
+  // We count ourselves before validating, so that whoever changes the state
+  // and then checks the count sees us
+  //----------------------------------------------------------------------------
+  tb_futex_lock(&b->lock);
+  __sync_fetch_and_add(&b->num_waiters, 1);
+  if(!validate(arg)) {
+    __sync_fetch_and_sub(&b->num_waiters, 1);
+    tb_futex_unlock(&b->lock);
+    return -EAGAIN;
+  }
+
+  struct waiter **cursor = &b->head;
+  while(*cursor && (*cursor)->priority >= node.priority)
+    cursor = &(*cursor)->next;
+  node.next = *cursor;
+  *cursor = &node;
+  tb_futex_unlock(&b->lock);
+
+  //----------------------------------------------------------------------------
+  // The waker holds a pointer to our node until it sets the futex, so we
+  // cannot leave early
+  //----------------------------------------------------------------------------
+  while(!__atomic_load_n(&node.futex, __ATOMIC_ACQUIRE))
+    SYSCALL3(__NR_futex, &node.futex, FUTEX_WAIT, 0);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Unpark up to num highest priority waiters; the callback, if any, is told
+// how many were unparked and whether there are more, and runs with the bucket
+// locked
+//------------------------------------------------------------------------------
+int tb_unpark(void *addr, int num, void (*callback)(void *, int, int),
+  void *arg)
+{
+  struct bucket *b = get_bucket(addr);
+  struct waiter *woken = 0;
+  struct waiter **tail = &woken;
+  int count = 0;
+  int more = 0;
+
+  __sync_synchronize();
+  if(!callback && !__atomic_load_n(&b->num_waiters, __ATOMIC_RELAXED))
+    return 0;
+
+  tb_futex_lock(&b->lock);
+  struct waiter **cursor = &b->head;
+  while(*cursor) {
+    struct waiter *w = *cursor;
+    if(w->addr != addr) {
+      cursor = &w->next;
+      continue;
+    }
+    if(count == num) {
+      more = 1;
+      break;
+    }
+    *cursor = w->next;
+    *tail = w;
+    tail = &w->next;
+    ++count;
+  }
+  *tail = 0;
+  __sync_fetch_and_sub(&b->num_waiters, count);
+  if(callback)
+    callback(arg, count, more);
+  tb_futex_unlock(&b->lock);
+
+  while(woken) {
+    struct waiter *w = woken;
+    woken = w->next;
+    __atomic_store_n(&w->futex, 1, __ATOMIC_RELEASE);
+    SYSCALL3(__NR_futex, &w->futex, FUTEX_WAKE, 1);
+  }
+  return count;
+}
+
+//------------------------------------------------------------------------------
+// Wait on the address if it still holds the value
+//------------------------------------------------------------------------------
+struct compare {
+  int *addr;
+  int  val;
+};
+
+static int compare_validate(void *arg)
+{
+  struct compare *c = arg;
+  return __atomic_load_n(c->addr, __ATOMIC_RELAXED) == c->val;
+}
+
+int tb_waitq_wait(int *addr, int val)
+{
+  struct compare c = {addr, val};
+  return tb_park(addr, compare_validate, &c);
+}
+
+//------------------------------------------------------------------------------
+// Wake up to num highest priority waiters
+//------------------------------------------------------------------------------
+int tb_waitq_wake(int *addr, int num)
+{
+  return tb_unpark(addr, num, 0, 0);
+}
+
+//------------------------------------------------------------------------------
+// Wait while the address holds the expected value
+//------------------------------------------------------------------------------
+int tb_atomic_wait(int *addr, int expected)
+{
+  return tb_waitq_wait(addr, expected);
+}
+
+//------------------------------------------------------------------------------
+// Wake up one waiter
+//------------------------------------------------------------------------------
+int tb_atomic_notify_one(int *addr)
+{
+  return tb_waitq_wake(addr, 1);
+}
+
+//------------------------------------------------------------------------------
+// Wake up all the waiters
+//------------------------------------------------------------------------------
+int tb_atomic_notify_all(int *addr)
+{
+  return tb_waitq_wake(addr, INT_MAX);
+}
@@ -31,6 +31,8 @@
 // Constants
 //------------------------------------------------------------------------------
 #define TBTHREAD_MAX_KEYS 1024
+#define TBTHREAD_MAX_PRIO_MUTEXES 32
+#define TBTHREAD_HAZARD_SLOTS 4
 #define TBTHREAD_MUTEX_NORMAL 0
 #define TBTHREAD_MUTEX_ERRORCHECK 1
 #define TBTHREAD_MUTEX_RECURSIVE 2
@@ -51,6 +53,26 @@
 #define TBTHREAD_PRIO_INHERIT 4
 #define TBTHREAD_PRIO_PROTECT 5
 
+#define TBTHREAD_WAKE_DEFAULT 0
+#define TBTHREAD_WAKE_PRIORITY 1
+
+#define TBTHREAD_RWLOCK_PREFER_WRITER 0
+#define TBTHREAD_RWLOCK_PREFER_READER 1
+#define TBTHREAD_RWLOCK_PHASE_FAIR 2
+
+#define TBTHREAD_WAIT_SEM 0
+#define TBTHREAD_WAIT_LATCH 1
+#define TBTHREAD_WAIT_WAITGROUP 2
+
+#define TBTHREAD_BARRIER_CENTRAL 0
+#define TBTHREAD_BARRIER_TREE 1
+#define TBTHREAD_BARRIER_SERIAL_THREAD 1
+
+#define TBTHREAD_STACK_MIN 16384
+#define TBTHREAD_STACK_DEFAULT 0
+#define TBTHREAD_STACK_NORESERVE 1
+#define TBTHREAD_STACK_POPULATE 2
+
 //------------------------------------------------------------------------------
 // List struct
 //------------------------------------------------------------------------------
@@ -65,7 +87,10 @@ typedef struct list {
 //------------------------------------------------------------------------------
 typedef struct
 {
+  void     *stack_addr;
   uint32_t  stack_size;
+  uint32_t  guard_size;
+  uint8_t   stack_mode;
   uint8_t   joinable;
   uint8_t   sched_inherit;
   uint8_t   sched_policy;
@@ -73,33 +98,10 @@ typedef struct
 } tbthread_attr_t;
 
 //------------------------------------------------------------------------------
-// Thread descriptor
+// Thread handle
 //------------------------------------------------------------------------------
-typedef struct tbthread
-{
-  struct tbthread *self;
-  void *stack;
-  uint32_t stack_size;
-  uint32_t tid;
-  void *(*fn)(void *);
-  void *arg;
-  void *retval;
-  struct
-  {
-    uint64_t seq;
-    void *data;
-  } tls[TBTHREAD_MAX_KEYS];
-  uint8_t join_status;
-  uint8_t cancel_status;
-  uint16_t sched_info;
-  uint16_t user_sched_info;
-  struct tbthread *joiner;
-  list_t cleanup_handlers;
-  list_t protect_mutexes;
-  list_t inherit_mutexes;
-  uint32_t start_status;
-  uint32_t lock;
-} *tbthread_t;
+struct tbthread;
+typedef uint64_t tbthread_t;
 
 //------------------------------------------------------------------------------
 // Mutex attributes
@@ -114,18 +116,20 @@ typedef struct
 //------------------------------------------------------------------------------
 // Mutex
 //------------------------------------------------------------------------------
-typedef struct
+typedef struct tbthread_mutex
 {
   int        futex;
   uint8_t    type;
   uint8_t    protocol;
   uint16_t   sched_info;
-  tbthread_t owner;
+  struct tbthread *owner;
   uint64_t   counter;
   uint32_t   internal_futex;
+  uint16_t   inherit_sched_info;
+  uint16_t   prio_index;
 } tbthread_mutex_t;
 
-#define TBTHREAD_MUTEX_INITIALIZER {0, 0, TBTHREAD_PRIO_NONE, 0, 0, 0, 0}
+#define TBTHREAD_MUTEX_INITIALIZER {0, 0, TBTHREAD_PRIO_NONE, 0, 0, 0, 0, 0, 0}
 
 //------------------------------------------------------------------------------
 // Once
@@ -138,29 +142,127 @@ typedef int tbthread_once_t;
 // RW lock
 //------------------------------------------------------------------------------
 typedef struct {
-  int lock;
-  int writers_queued;
+  uint32_t state;
   int rd_futex;
   int wr_futex;
-  tbthread_t writer;
-  int readers;
+  int rd_phase;
+  uint8_t wake_order;
+  uint8_t kind;
+  struct tbthread *upgrader;
 } tbthread_rwlock_t;
 
-#define TBTHREAD_RWLOCK_INIT {0, 0, 0, 0, 0, 0}
+#define TBTHREAD_RWLOCK_INIT {0, 0, 0, 0, TBTHREAD_WAKE_DEFAULT, \
+    TBTHREAD_RWLOCK_PREFER_WRITER, 0}
+
+typedef struct {
+  uint8_t wake_order;
+  uint8_t kind;
+} tbthread_rwlockattr_t;
+
+//------------------------------------------------------------------------------
+// Reader-biased RW lock
+//------------------------------------------------------------------------------
+typedef struct {
+  tbthread_rwlock_t rwlock;
+  uint32_t rbias;
+  uint64_t inhibit_until;
+} tbthread_brlock_t;
+
+#define TBTHREAD_BRLOCK_INIT {TBTHREAD_RWLOCK_INIT, 1, 0}
+
+//------------------------------------------------------------------------------
+// Seqlock
+//------------------------------------------------------------------------------
+typedef struct {
+  uint32_t seq;
+  int lock;
+} tbthread_seqlock_t;
+
+#define TBTHREAD_SEQLOCK_INIT {0, 0}
+
+//------------------------------------------------------------------------------
+// Semaphore
+//------------------------------------------------------------------------------
+typedef struct {
+  uint64_t value;
+} tbthread_sem_t;
+
+#define TBTHREAD_SEM_VALUE_MAX 0x7fffffff
+#define TBTHREAD_SEM_INIT(value) {value}
+
+//------------------------------------------------------------------------------
+// Byte lock
+//------------------------------------------------------------------------------
+typedef struct {
+  uint8_t state;
+} tbthread_bytelock_t;
+
+#define TBTHREAD_BYTELOCK_INIT {0}
+
+//------------------------------------------------------------------------------
+// Latch and wait-group
+//------------------------------------------------------------------------------
+typedef struct {
+  uint32_t value;
+} tbthread_latch_t;
+
+typedef struct {
+  uint32_t value;
+} tbthread_waitgroup_t;
+
+#define TBTHREAD_LATCH_COUNT_MAX 0x00ffffff
+#define TBTHREAD_WAITGROUP_COUNT_MAX 0x00ffffff
+#define TBTHREAD_LATCH_INIT(count) {count}
+#define TBTHREAD_WAITGROUP_INIT {0}
+
+//------------------------------------------------------------------------------
+// Wait-any item
+//------------------------------------------------------------------------------
+typedef struct {
+  int type;
+  void *object;
+} tb_wait_item_t;
+
+//------------------------------------------------------------------------------
+// Barrier
+//------------------------------------------------------------------------------
+typedef struct {
+  int seq;
+  uint32_t sleepers;
+  uint32_t count;
+  uint32_t remaining;
+  uint32_t ticket;
+  uint32_t spin;
+  uint8_t kind;
+  void *tree;
+} tbthread_barrier_t;
+
+typedef struct {
+  uint8_t kind;
+  uint32_t spin;
+} tbthread_barrierattr_t;
 
 //------------------------------------------------------------------------------
 // Condvar
 //------------------------------------------------------------------------------
 typedef struct {
+  uint64_t wseq;
+  uint64_t signals[2];
+  int wake_seq[2];
+  uint32_t g1_left;
+  uint32_t g1_start;
+  uint32_t waiters;
   int lock;
-  int futex;
-  uint64_t waiters;
-  uint64_t signal_num;
-  uint64_t broadcast_seq;
   tbthread_mutex_t *mutex;
+  uint8_t wake_order;
 } tbthread_cond_t;
 
-#define TBTHREAD_COND_INITIALIZER {0, 0, 0, 0, 0, 0}
+#define TBTHREAD_COND_INITIALIZER \
+  {0, {0, 0}, {0, 0}, 0, 0, 0, 0, 0, TBTHREAD_WAKE_DEFAULT}
+
+typedef struct {
+  uint8_t wake_order;
+} tbthread_condattr_t;
 
 //------------------------------------------------------------------------------
 // General threading
@@ -169,12 +271,17 @@ void tbthread_init();
 void tbthread_finit();
 void tbthread_attr_init(tbthread_attr_t *attr);
 int tbthread_attr_setdetachstate(tbthread_attr_t *attr, int state);
+int tbthread_attr_setstacksize(tbthread_attr_t *attr, size_t size);
+int tbthread_attr_setguardsize(tbthread_attr_t *attr, size_t size);
+int tbthread_attr_setstack(tbthread_attr_t *attr, void *addr, size_t size);
+int tbthread_attr_setstackmode(tbthread_attr_t *attr, int mode);
 int tbthread_create(tbthread_t *thread, const tbthread_attr_t *attrs,
   void *(*f)(void *), void *arg);
 void tbthread_exit(void *retval);
 int tbthread_detach(tbthread_t thread);
 int tbthread_join(tbthread_t thread, void **retval);
 int tbthread_equal(tbthread_t t1, tbthread_t t2);
+int tbthread_gettid(tbthread_t thread);
 int tbthread_once(tbthread_once_t *once, void (*func)(void));
 int tbthread_cancel(tbthread_t thread);
 void tbthread_cleanup_push(void (*func)(void *), void *arg);
@@ -228,23 +335,165 @@ int tbthread_mutex_setprioceiling(tbthread_mutex_t *mutex, int ceiling,
 //------------------------------------------------------------------------------
 // RW Lock
 //-----------------------------------------------------------------------------
-int tbthread_rwlock_init(tbthread_rwlock_t *rwlock);
+int tbthread_rwlockattr_init(tbthread_rwlockattr_t *attr);
+int tbthread_rwlockattr_destroy(tbthread_rwlockattr_t *attr);
+int tbthread_rwlockattr_setwakeorder(tbthread_rwlockattr_t *attr, int order);
+int tbthread_rwlockattr_setkind(tbthread_rwlockattr_t *attr, int kind);
+
+int tbthread_rwlock_init(tbthread_rwlock_t *rwlock,
+  const tbthread_rwlockattr_t *attr);
 int tbthread_rwlock_destroy(tbthread_rwlock_t *rwlock);
 
 int tbthread_rwlock_rdlock(tbthread_rwlock_t *rwlock);
 int tbthread_rwlock_wrlock(tbthread_rwlock_t *rwlock);
 int tbthread_rwlock_unlock(tbthread_rwlock_t *rwlock);
 
+int tbthread_rwlock_uprdlock(tbthread_rwlock_t *rwlock);
+int tbthread_rwlock_upgrade(tbthread_rwlock_t *rwlock);
+int tbthread_rwlock_downgrade(tbthread_rwlock_t *rwlock);
+
 int tbthread_rwlock_tryrdlock(tbthread_rwlock_t *rwlock);
 int tbthread_rwlock_trywrlock(tbthread_rwlock_t *rwlock);
 
+//------------------------------------------------------------------------------
+// Reader-biased RW Lock
+//------------------------------------------------------------------------------
+int tbthread_brlock_init(tbthread_brlock_t *lock);
+int tbthread_brlock_destroy(tbthread_brlock_t *lock);
+
+int tbthread_brlock_rdlock(tbthread_brlock_t *lock);
+int tbthread_brlock_wrlock(tbthread_brlock_t *lock);
+int tbthread_brlock_unlock(tbthread_brlock_t *lock);
+
+//------------------------------------------------------------------------------
+// Seqlock
+//------------------------------------------------------------------------------
+int tbthread_seqlock_init(tbthread_seqlock_t *lock);
+void tbthread_seqlock_write_lock(tbthread_seqlock_t *lock);
+void tbthread_seqlock_write_unlock(tbthread_seqlock_t *lock);
+uint32_t tbthread_seqlock_read_begin(const tbthread_seqlock_t *lock);
+int tbthread_seqlock_read_retry(const tbthread_seqlock_t *lock, uint32_t seq);
+
+//------------------------------------------------------------------------------
+// Semaphore
+//------------------------------------------------------------------------------
+int tbthread_sem_init(tbthread_sem_t *sem, unsigned value);
+int tbthread_sem_destroy(tbthread_sem_t *sem);
+int tbthread_sem_getvalue(tbthread_sem_t *sem, int *value);
+
+int tbthread_sem_post(tbthread_sem_t *sem);
+int tbthread_sem_post_n(tbthread_sem_t *sem, unsigned n);
+int tbthread_sem_wait(tbthread_sem_t *sem);
+int tbthread_sem_wait_n(tbthread_sem_t *sem, unsigned n);
+int tbthread_sem_trywait(tbthread_sem_t *sem);
+int tbthread_sem_trywait_n(tbthread_sem_t *sem, unsigned n);
+int tbthread_sem_timedwait(tbthread_sem_t *sem, const struct timespec *abstime);
+int tbthread_sem_timedwait_n(tbthread_sem_t *sem, unsigned n,
+  const struct timespec *abstime);
+
+//------------------------------------------------------------------------------
+// Byte and bit locks
+//------------------------------------------------------------------------------
+int tbthread_bytelock_lock(tbthread_bytelock_t *lock);
+int tbthread_bytelock_trylock(tbthread_bytelock_t *lock);
+int tbthread_bytelock_unlock(tbthread_bytelock_t *lock);
+
+int tbthread_bitlock_lock(uint32_t *word, int bit);
+int tbthread_bitlock_trylock(uint32_t *word, int bit);
+int tbthread_bitlock_unlock(uint32_t *word, int bit);
+
+//------------------------------------------------------------------------------
+// Atomic wait and notify
+//------------------------------------------------------------------------------
+int tb_atomic_wait(int *addr, int expected);
+int tb_atomic_notify_one(int *addr);
+int tb_atomic_notify_all(int *addr);
+
+//------------------------------------------------------------------------------
+// Latch and wait-group
+//------------------------------------------------------------------------------
+int tbthread_latch_init(tbthread_latch_t *latch, unsigned count);
+int tbthread_latch_destroy(tbthread_latch_t *latch);
+int tbthread_latch_count_down(tbthread_latch_t *latch);
+int tbthread_latch_count_down_n(tbthread_latch_t *latch, unsigned n);
+int tbthread_latch_wait(tbthread_latch_t *latch);
+int tbthread_latch_trywait(tbthread_latch_t *latch);
+
+int tbthread_waitgroup_init(tbthread_waitgroup_t *wg);
+int tbthread_waitgroup_destroy(tbthread_waitgroup_t *wg);
+int tbthread_waitgroup_add(tbthread_waitgroup_t *wg, int delta);
+int tbthread_waitgroup_done(tbthread_waitgroup_t *wg);
+int tbthread_waitgroup_wait(tbthread_waitgroup_t *wg);
+
+//------------------------------------------------------------------------------
+// Waiting for any of many primitives
+//------------------------------------------------------------------------------
+int tb_wait_any(tb_wait_item_t *items, int num, const struct timespec *abstime);
+
+//------------------------------------------------------------------------------
+// Barrier
+//------------------------------------------------------------------------------
+int tbthread_barrierattr_init(tbthread_barrierattr_t *attr);
+int tbthread_barrierattr_destroy(tbthread_barrierattr_t *attr);
+int tbthread_barrierattr_setkind(tbthread_barrierattr_t *attr, int kind);
+int tbthread_barrierattr_setspin(tbthread_barrierattr_t *attr, uint32_t spin);
+
+int tbthread_barrier_init(tbthread_barrier_t *barrier,
+  const tbthread_barrierattr_t *attr, uint32_t count);
+int tbthread_barrier_destroy(tbthread_barrier_t *barrier);
+int tbthread_barrier_wait(tbthread_barrier_t *barrier);
+int tbthread_barrier_wait_id(tbthread_barrier_t *barrier, uint32_t id);
+
 //------------------------------------------------------------------------------
 // Condvar
 //------------------------------------------------------------------------------
+int tbthread_condattr_init(tbthread_condattr_t *attr);
+int tbthread_condattr_destroy(tbthread_condattr_t *attr);
+int tbthread_condattr_setwakeorder(tbthread_condattr_t *attr, int order);
+
+int tbthread_cond_init(tbthread_cond_t *cond, const tbthread_condattr_t *attr);
+int tbthread_cond_destroy(tbthread_cond_t *cond);
 int tbthread_cond_broadcast(tbthread_cond_t *cond);
 int tbthread_cond_signal(tbthread_cond_t *cond);
 int tbthread_cond_wait(tbthread_cond_t *cond, tbthread_mutex_t *mutex);
 
+//------------------------------------------------------------------------------
+// RCU
+//------------------------------------------------------------------------------
+struct tb_rcu_head {
+  struct tb_rcu_head *next;
+  void (*func)(struct tb_rcu_head *head);
+};
+
+#define tb_rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define tb_rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+void tb_rcu_read_lock();
+void tb_rcu_read_unlock();
+void tb_rcu_quiescent_state();
+void tb_rcu_thread_online();
+void tb_rcu_thread_offline();
+void tb_synchronize_rcu();
+void tb_call_rcu(struct tb_rcu_head *head,
+  void (*func)(struct tb_rcu_head *head));
+
+//------------------------------------------------------------------------------
+// Hazard pointers
+//------------------------------------------------------------------------------
+void *tb_hazard_protect(int slot, void **src);
+void tb_hazard_set(int slot, void *ptr);
+void tb_hazard_clear(int slot);
+int tb_hazard_retire(void *ptr, void (*func)(void *));
+void tb_hazard_scan();
+
+//------------------------------------------------------------------------------
+// Lock statistics
+//------------------------------------------------------------------------------
+void tb_lockstat_enable(int enable);
+void tb_lockstat_name(const void *lock, const char *name);
+void tb_lockstat_reset();
+void tb_lockstat_dump();
+
 //------------------------------------------------------------------------------
 // Utility functions
 //------------------------------------------------------------------------------
@@ -265,6 +514,9 @@ int tbclone(int (*fn)(void *), void *arg, int flags, void *child_stack, ...
 void *tbbrk(void *addr);
 
 uint64_t tbtime();
+uint64_t tbtime_ns();
+void tb_heavy_barrier();
+#define tb_light_barrier() asm volatile("" ::: "memory")
 uint32_t tbrandom(uint32_t *seed);
 const char *tbstrerror(int errno);
 
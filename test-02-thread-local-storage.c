@@ -26,6 +26,7 @@
 tbthread_key_t key1;
 tbthread_key_t key2;
 tbthread_key_t key3;
+tbthread_key_t key4;
 
 //------------------------------------------------------------------------------
 // TLS destructors
@@ -46,6 +47,12 @@ void dest3(void *data)
   free(data);
 }
 
+void dest4(void *data)
+{
+  tbprint("[thread 0x%llx] Calling dest4\n", tbthread_self());
+  free(data);
+}
+
 //------------------------------------------------------------------------------
 // Thread function
 //------------------------------------------------------------------------------
@@ -59,21 +66,26 @@ void *thread_func(void *arg)
   void *data1 = malloc(20);
   void *data2 = malloc(20);
   void *data3 = malloc(20);
+  void *data4 = malloc(20);
   tbthread_setspecific(key1, data1);
   tbthread_setspecific(key2, data2);
   tbthread_setspecific(key3, data3);
+  tbthread_setspecific(key4, data4);
 
   tbprint("[thread 0x%llx] Sleeping 3 seconds\n", self);
   tbsleep(3);
   void *data1r = tbthread_getspecific(key1);
   void *data2r = tbthread_getspecific(key2);
   void *data3r = tbthread_getspecific(key3);
+  void *data4r = tbthread_getspecific(key4);
   if(data1r != data1)
     tbprint("[thread 0x%llx] Error: datar != data\n", self);
   if(data2r != 0)
     tbprint("[thread 0x%llx] Error: data2r != 0\n", self);
   if(data3r != data3)
     tbprint("[thread 0x%llx] Error: data3r != data3\n", self);
+  if(data4r != data4)
+    tbprint("[thread 0x%llx] Error: data4r != data4\n", self);
   free(data2);
   free(data1);
   tbthread_setspecific(key1, 0);
@@ -105,7 +117,22 @@ int main(int argc, char **argv)
   tbthread_key_delete(key3);
   tbthread_key_create(&key3, dest3);
   tbthread_key_create(&key1, dest1);
-  tbprint("[thread main] TLS keys: %u, %u, %u\n", key1, key2, key3);
+
+  //----------------------------------------------------------------------------
+  // Get a key beyond the first block, so that the threads need to allocate
+  // a block for it
+  //----------------------------------------------------------------------------
+  tbthread_key_t filler[64];
+  int num_filler = 0;
+  while(1) {
+    tbthread_key_create(&key4, dest4);
+    if(key4 >= 64)
+      break;
+    filler[num_filler++] = key4;
+  }
+  for(int i = 0; i < num_filler; ++i)
+    tbthread_key_delete(filler[i]);
+  tbprint("[thread main] TLS keys: %u, %u, %u, %u\n", key1, key2, key3, key4);
 
   //----------------------------------------------------------------------------
   // Spawn the threads
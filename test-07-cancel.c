@@ -51,9 +51,9 @@ void *thread_func(void *arg)
   tbthread_setcancelstate(TBTHREAD_CANCEL_DISABLE, 0);
   tbprint("[thread 0x%llx] Started\n", self);
 
-  tbthread_cleanup_push(cleanup1, self);
-  tbthread_cleanup_push(cleanup2, self);
-  tbthread_cleanup_push(cleanup3, self);
+  tbthread_cleanup_push(cleanup1, (void *)self);
+  tbthread_cleanup_push(cleanup2, (void *)self);
+  tbthread_cleanup_push(cleanup3, (void *)self);
 
   if(mode == CANCEL_ASYNC)
     tbthread_setcanceltype(TBTHREAD_CANCEL_ASYNCHRONOUS, 0);
@@ -37,7 +37,7 @@ void once_func()
 {
   tbthread_t self = tbthread_self();
   tbthread_setcancelstate(TBTHREAD_CANCEL_DISABLE, 0);
-  tbthread_cleanup_push(cleanup, self);
+  tbthread_cleanup_push(cleanup, (void *)self);
   tbprint("[thread 0x%llx] Running the once function\n", self);
   if(!once_one) {
     once_thread = self;
@@ -146,6 +146,35 @@ void *thread_func_inherit_0(void *arg)
   return 0;
 }
 
+//------------------------------------------------------------------------------
+// Thread function - PRIO INHERIT chain
+//------------------------------------------------------------------------------
+void *thread_func_chain(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  struct tharg *a = arg;
+  tbprint("[thread 0x%llx] Starting #%d\n", self, a->num);
+  print_sched_n(a->before);
+
+  tbthread_mutex_lock(a->m[0]);
+  tbprint("[thread 0x%llx] Mutex 0 locked\n", self);
+  if(a->m[1]) {
+    tbthread_mutex_lock(a->m[1]);
+    tbprint("[thread 0x%llx] Mutex 1 locked\n", self);
+  }
+  print_sched_n(a->inside);
+
+  if(a->m[1]) {
+    tbthread_mutex_unlock(a->m[1]);
+    tbprint("[thread 0x%llx] Mutex 1 unlocked\n", self);
+  }
+  tbthread_mutex_unlock(a->m[0]);
+  tbprint("[thread 0x%llx] Mutex 0 unlocked\n", self);
+  print_sched_n(a->after);
+  tbprint("[thread 0x%llx] Done\n", self);
+  return 0;
+}
+
 //------------------------------------------------------------------------------
 // Run the threads
 //------------------------------------------------------------------------------
@@ -264,6 +293,67 @@ int main(int argc, char **argv)
     goto exit;
   tbprint("---\n");
 
+  //----------------------------------------------------------------------------
+  // PRIO INHERIT chain: #3 waits for #2, #2 waits for #1, #1 waits for #0, so
+  // #0 should run with the priority of #3
+  //----------------------------------------------------------------------------
+  memset(arg, 0, THREADS*sizeof(struct tharg));
+  for(int i = 0; i < THREADS; ++i) {
+    tbthread_attr_init(&attr[i]);
+    tbthread_attr_setinheritsched(&attr[i], TBTHREAD_EXPLICIT_SCHED);
+    arg[i].num = i;
+    m_inh_func[i] = thread_func_chain;
+  }
+  tbthread_attr_setschedpolicy(&attr[3], SCHED_FIFO);
+  tbthread_attr_setschedpolicy(&attr[4], SCHED_RR);
+  tbthread_attr_setschedpriority(&attr[3], 8);
+  tbthread_attr_setschedpriority(&attr[4], 3);
+
+  arg[0].m[0] = &m_inh[0]; arg[0].before = 0; arg[0].inside = 6; arg[0].after = 1;
+  arg[1].m[0] = &m_inh[1]; arg[1].m[1] = &m_inh[0]; arg[1].before = 1; arg[1].inside = 1;
+  arg[2].m[0] = &m_inh[2]; arg[2].m[1] = &m_inh[1]; arg[2].before = 2; arg[2].inside = 1;
+  arg[3].m[0] = &m_inh[2]; arg[3].before = 3; arg[3].inside = 1;
+  arg[4].m[0] = &m_inh[0]; arg[4].before = 3; arg[4].inside = 1;
+
+  tbprint("Testing PRIO_INHERIT chains\n");
+  if((st = run(attr, arg, m_inh_func)))
+    goto exit;
+  tbprint("---\n");
+
+  //----------------------------------------------------------------------------
+  // A thread can hold at most TBTHREAD_MAX_PRIO_MUTEXES priority mutexes, the
+  // next one must be refused rather than silently left without a boost
+  //----------------------------------------------------------------------------
+  tbprint("Testing the priority mutex limit\n");
+  tbthread_mutex_t m_lim[TBTHREAD_MAX_PRIO_MUTEXES+1];
+  tbthread_mutex_t m_over_inh;
+  for(int i = 0; i < TBTHREAD_MAX_PRIO_MUTEXES+1; ++i)
+    tbthread_mutex_init(&m_lim[i], i%2 ? &m_inh_attr[0] : &m_prot_attr[0]);
+  tbthread_mutex_init(&m_over_inh, &m_inh_attr[0]);
+  for(int i = 0; i < TBTHREAD_MAX_PRIO_MUTEXES; ++i)
+    if(tbthread_mutex_lock(&m_lim[i])) {
+      tbprint("Failed to lock mutex #%d\n", i);
+      st = 1;
+      goto exit;
+    }
+  int ret1 = tbthread_mutex_lock(&m_lim[TBTHREAD_MAX_PRIO_MUTEXES]);
+  int ret2 = tbthread_mutex_trylock(&m_lim[TBTHREAD_MAX_PRIO_MUTEXES]);
+  int ret3 = tbthread_mutex_lock(&m_over_inh);
+  for(int i = 0; i < TBTHREAD_MAX_PRIO_MUTEXES; ++i)
+    tbthread_mutex_unlock(&m_lim[i]);
+  if(ret1 != -EAGAIN || ret2 != -EAGAIN || ret3 != -EAGAIN) {
+    tbprint("Expected -EAGAIN, got %d, %d and %d\n", ret1, ret2, ret3);
+    st = 1;
+    goto exit;
+  }
+  if(tbthread_mutex_lock(&m_lim[TBTHREAD_MAX_PRIO_MUTEXES])) {
+    tbprint("Failed to lock the extra mutex after unlocking the rest\n");
+    st = 1;
+    goto exit;
+  }
+  tbthread_mutex_unlock(&m_lim[TBTHREAD_MAX_PRIO_MUTEXES]);
+  tbprint("---\n");
+
 
 exit:
   tbthread_finit();
@@ -0,0 +1,105 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <string.h>
+
+#define THREADS 5
+
+tbthread_mutex_t hot  = TBTHREAD_MUTEX_INITIALIZER;
+tbthread_mutex_t cold = TBTHREAD_MUTEX_INITIALIZER;
+tbthread_rwlock_t rwlock = TBTHREAD_RWLOCK_INIT;
+int counter = 0;
+
+//------------------------------------------------------------------------------
+// Thread function
+//------------------------------------------------------------------------------
+void *thread_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  int num = *(int *)arg;
+  tbprint("[thread 0x%llx] Starting #%d\n", self, num);
+
+  for(int i = 0; i < 50; ++i) {
+    tbthread_mutex_lock(&hot);
+    ++counter;
+    for(uint64_t z = 0; z < 1000000ULL; ++z);
+    tbthread_mutex_unlock(&hot);
+
+    void *data = malloc(64);
+    free(data);
+
+    tbthread_rwlock_rdlock(&rwlock);
+    tbthread_rwlock_unlock(&rwlock);
+  }
+
+  tbthread_mutex_lock(&cold);
+  tbthread_mutex_unlock(&cold);
+
+  tbprint("[thread 0x%llx] Done #%d\n", self, num);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_t       thread[THREADS];
+  int              targ[THREADS];
+  tbthread_attr_t  attr;
+  int              st = 0;
+
+  tb_lockstat_name(&hot, "hot");
+  tb_lockstat_name(&cold, "cold");
+  tb_lockstat_enable(1);
+
+  //----------------------------------------------------------------------------
+  // Spawn the threads
+  //----------------------------------------------------------------------------
+  tbthread_attr_init(&attr);
+  for(int i = 0; i < THREADS; ++i) {
+    targ[i] = i;
+    st = tbthread_create(&thread[i], &attr, thread_func, &targ[i]);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+  }
+
+  tbprint("[thread main] Threads spawned successfully\n");
+
+  for(int i = 0; i < THREADS; ++i) {
+    st = tbthread_join(thread[i], 0);
+    if(st != 0) {
+      tbprint("Failed to join thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+  }
+
+  tbprint("[thread main] Threads joined, counter: %d\n", counter);
+  tb_lockstat_enable(0);
+  tb_lockstat_dump();
+
+exit:
+  tbthread_finit();
+  return st;
+};
@@ -0,0 +1,190 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <string.h>
+
+#define THREADS 5
+
+tbthread_mutex_t  mutex = TBTHREAD_MUTEX_INITIALIZER;
+tbthread_cond_t   cond;
+tbthread_rwlock_t rwlock;
+int tokens = 0;
+int order[THREADS];
+int num_done = 0;
+
+//------------------------------------------------------------------------------
+// Thread function - condvar
+//------------------------------------------------------------------------------
+void *thread_func_cond(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  int priority = *(int *)arg;
+  tbprint("[thread 0x%llx] Waiting for the condvar, priority %d\n", self,
+          priority);
+  tbthread_mutex_lock(&mutex);
+  while(!tokens)
+    tbthread_cond_wait(&cond, &mutex);
+  --tokens;
+  order[num_done++] = priority;
+  tbthread_mutex_unlock(&mutex);
+  tbprint("[thread 0x%llx] Woken up, priority %d\n", self, priority);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Thread function - rwlock
+//------------------------------------------------------------------------------
+void *thread_func_rwlock(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  int priority = *(int *)arg;
+  tbprint("[thread 0x%llx] Waiting for the rwlock, priority %d\n", self,
+          priority);
+  tbthread_rwlock_wrlock(&rwlock);
+  order[num_done++] = priority;
+  tbthread_rwlock_unlock(&rwlock);
+  tbprint("[thread 0x%llx] Got the rwlock, priority %d\n", self, priority);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Run the threads and check the order in which they got woken up
+//------------------------------------------------------------------------------
+int run_threads(void *(*func)(void *), void (*release)())
+{
+  tbthread_t      thread[THREADS];
+  tbthread_attr_t attr[THREADS];
+  int             priority[THREADS] = {3, 7, 1, 9, 5};
+  int             st = 0;
+
+  num_done = 0;
+  for(int i = 0; i < THREADS; ++i) {
+    tbthread_attr_init(&attr[i]);
+    tbthread_attr_setinheritsched(&attr[i], TBTHREAD_EXPLICIT_SCHED);
+    tbthread_attr_setschedpolicy(&attr[i], SCHED_FIFO);
+    tbthread_attr_setschedpriority(&attr[i], priority[i]);
+    st = tbthread_create(&thread[i], &attr[i], func, &priority[i]);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      return st;
+    }
+    tbsleep(1);
+  }
+
+  (*release)();
+
+  for(int i = 0; i < THREADS; ++i) {
+    st = tbthread_join(thread[i], 0);
+    if(st != 0) {
+      tbprint("Failed to join thread %d: %s\n", i, tbstrerror(-st));
+      return st;
+    }
+  }
+
+  for(int i = 1; i < THREADS; ++i)
+    if(order[i-1] < order[i]) {
+      tbprint("[thread driver] Wrong wake up order\n");
+      return -EINVAL;
+    }
+  tbprint("[thread driver] Threads woken up in priority order\n");
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Release the waiters
+//------------------------------------------------------------------------------
+void release_cond()
+{
+  for(int i = 0; i < THREADS; ++i) {
+    tbthread_mutex_lock(&mutex);
+    ++tokens;
+    tbthread_cond_signal(&cond);
+    tbthread_mutex_unlock(&mutex);
+    tbsleep(1);
+  }
+}
+
+void release_rwlock()
+{
+  tbthread_rwlock_unlock(&rwlock);
+}
+
+//------------------------------------------------------------------------------
+// Driver thread, it runs with a higher priority than the waiters and lets
+// them block one by one in the order in which they have been created
+//------------------------------------------------------------------------------
+void *driver_func(void *arg)
+{
+  tbthread_condattr_t   cattr;
+  tbthread_rwlockattr_t rwattr;
+  int                   st = 0;
+
+  tbthread_condattr_init(&cattr);
+  tbthread_condattr_setwakeorder(&cattr, TBTHREAD_WAKE_PRIORITY);
+  tbthread_cond_init(&cond, &cattr);
+
+  tbprint("[thread driver] Testing the condvar\n");
+  st = run_threads(thread_func_cond, release_cond);
+  if(st) goto exit;
+
+  tbthread_rwlockattr_init(&rwattr);
+  tbthread_rwlockattr_setwakeorder(&rwattr, TBTHREAD_WAKE_PRIORITY);
+  tbthread_rwlock_init(&rwlock, &rwattr);
+  tbthread_rwlock_wrlock(&rwlock);
+
+  tbprint("[thread driver] Testing the rwlock\n");
+  st = run_threads(thread_func_rwlock, release_rwlock);
+
+exit:
+  tbthread_cond_destroy(&cond);
+  tbthread_rwlock_destroy(&rwlock);
+  return (void *)(intptr_t)st;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_t      driver;
+  tbthread_attr_t attr;
+  void           *ret = 0;
+  int             st = 0;
+
+  tbthread_attr_init(&attr);
+  tbthread_attr_setinheritsched(&attr, TBTHREAD_EXPLICIT_SCHED);
+  tbthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  tbthread_attr_setschedpriority(&attr, 50);
+  st = tbthread_create(&driver, &attr, driver_func, 0);
+  if(st != 0) {
+    tbprint("Failed to spawn the driver thread: %s\n", tbstrerror(-st));
+    goto exit;
+  }
+
+  st = tbthread_join(driver, &ret);
+  if(st == 0)
+    st = (intptr_t)ret;
+
+exit:
+  tbthread_finit();
+  return st;
+};
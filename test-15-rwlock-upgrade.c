@@ -0,0 +1,320 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <string.h>
+
+#define READERS 3
+
+tbthread_rwlock_t lock;
+char order[8];
+int num_done = 0;
+
+//------------------------------------------------------------------------------
+// Thread functions
+//------------------------------------------------------------------------------
+void *reader_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  int secs = *(int *)arg;
+  tbthread_rwlock_rdlock(&lock);
+  tbprint("[thread 0x%llx] Read lock taken, holding for %ds\n", self, secs);
+  order[num_done++] = 'r';
+  tbsleep(secs);
+  tbthread_rwlock_unlock(&lock);
+  tbprint("[thread 0x%llx] Read lock released\n", self);
+  return 0;
+}
+
+void *writer_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  tbthread_rwlock_wrlock(&lock);
+  tbprint("[thread 0x%llx] Write lock taken\n", self);
+  order[num_done++] = 'w';
+  tbthread_rwlock_unlock(&lock);
+  return 0;
+}
+
+void *upgrader_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  tbthread_rwlock_uprdlock(&lock);
+  tbprint("[thread 0x%llx] Upgradable read lock taken\n", self);
+  order[num_done++] = 'u';
+  tbthread_rwlock_unlock(&lock);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Spawn a thread
+//------------------------------------------------------------------------------
+tbthread_t spawn(void *(*func)(void *), void *arg)
+{
+  tbthread_t      thread;
+  tbthread_attr_t attr;
+  tbthread_attr_init(&attr);
+  int st = tbthread_create(&thread, &attr, func, arg);
+  if(st != 0) {
+    tbprint("Failed to spawn a thread: %s\n", tbstrerror(-st));
+    return 0;
+  }
+  return thread;
+}
+
+//------------------------------------------------------------------------------
+// Check the status
+//------------------------------------------------------------------------------
+const char *strstatus(int status)
+{
+  return status ? tbstrerror(-status) : "OK";
+}
+
+int check(const char *what, int status, int expected)
+{
+  tbprint("[thread main] %s: %s\n", what, strstatus(status));
+  if(status != expected) {
+    tbprint("[thread main] Expected: %s\n", strstatus(expected));
+    return -EINVAL;
+  }
+  return 0;
+}
+
+int check_num(const char *what, int num, int expected)
+{
+  tbprint("[thread main] %s: %d\n", what, num);
+  if(num != expected) {
+    tbprint("[thread main] Expected: %d\n", expected);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Test the upgrades and downgrades
+//------------------------------------------------------------------------------
+int test_upgrade()
+{
+  tbthread_t thread[READERS+1];
+  int        secs[READERS];
+  int        st = 0;
+
+  tbprint("[thread main] Testing upgrades\n");
+  tbthread_rwlock_init(&lock, 0);
+  tbthread_rwlock_uprdlock(&lock);
+
+  for(int i = 0; i < READERS; ++i) {
+    secs[i] = i+1;
+    thread[i] = spawn(reader_func, &secs[i]);
+  }
+  tbsleep(1);
+
+  //----------------------------------------------------------------------------
+  // The readers coexist with the upgrader, the other upgraders do not
+  //----------------------------------------------------------------------------
+  thread[READERS] = spawn(upgrader_func, 0);
+  tbsleep(1);
+  if((st = check_num("Readers sharing with the upgrader", num_done, READERS)))
+    return st;
+
+  //----------------------------------------------------------------------------
+  // Upgrade, the new readers must wait
+  //----------------------------------------------------------------------------
+  st = tbthread_rwlock_upgrade(&lock);
+  if((st = check("Upgrade", st, 0)))
+    return st;
+  if((st = check("Try read lock", tbthread_rwlock_tryrdlock(&lock), -EBUSY)))
+    return st;
+
+  st = tbthread_rwlock_downgrade(&lock);
+  if((st = check("Downgrade", st, 0)))
+    return st;
+  if((st = check("Try read lock", tbthread_rwlock_tryrdlock(&lock), 0)))
+    return st;
+  tbthread_rwlock_unlock(&lock);
+  if((st = check("Try write lock", tbthread_rwlock_trywrlock(&lock), -EBUSY)))
+    return st;
+  tbthread_rwlock_unlock(&lock);
+
+  for(int i = 0; i < READERS+1; ++i)
+    tbthread_join(thread[i], 0);
+  if((st = check_num("Upgraders done", num_done, READERS+1)))
+    return st;
+  return tbthread_rwlock_destroy(&lock);
+}
+
+//------------------------------------------------------------------------------
+// Test the preference; a reader holds the lock, a writer waits for it
+// and a second reader comes in
+//------------------------------------------------------------------------------
+int test_preference(const char *name, int kind, int expected)
+{
+  tbthread_rwlockattr_t attr;
+  tbthread_t            thread;
+  int                   st;
+
+  tbprint("[thread main] Testing %s\n", name);
+  tbthread_rwlockattr_init(&attr);
+  tbthread_rwlockattr_setkind(&attr, kind);
+  tbthread_rwlock_init(&lock, &attr);
+
+  tbthread_rwlock_rdlock(&lock);
+  num_done = 0;
+  thread = spawn(writer_func, 0);
+  tbsleep(1);
+
+  st = tbthread_rwlock_tryrdlock(&lock);
+  if(st == 0)
+    tbthread_rwlock_unlock(&lock);
+  tbthread_rwlock_unlock(&lock);
+  tbthread_join(thread, 0);
+
+  if((st = check("Try read lock with a writer waiting", st, expected)))
+    return st;
+  return tbthread_rwlock_destroy(&lock);
+}
+
+//------------------------------------------------------------------------------
+// Test the phase fairness; a writer holds the lock, a reader and a writer
+// wait for it - the reader goes first. Then, a reader holds the lock, a
+// writer and a reader wait for it - the writer goes first.
+//------------------------------------------------------------------------------
+int test_phase_fair()
+{
+  tbthread_rwlockattr_t attr;
+  tbthread_t            thread[2];
+  int                   secs = 0;
+  int                   st;
+
+  tbprint("[thread main] Testing phase fairness\n");
+  tbthread_rwlockattr_init(&attr);
+  tbthread_rwlockattr_setkind(&attr, TBTHREAD_RWLOCK_PHASE_FAIR);
+  tbthread_rwlock_init(&lock, &attr);
+
+  num_done = 0;
+  tbthread_rwlock_wrlock(&lock);
+  thread[0] = spawn(writer_func, 0);
+  tbsleep(1);
+  thread[1] = spawn(reader_func, &secs);
+  tbsleep(1);
+  tbthread_rwlock_unlock(&lock);
+  tbthread_join(thread[0], 0);
+  tbthread_join(thread[1], 0);
+
+  tbthread_rwlock_rdlock(&lock);
+  thread[0] = spawn(writer_func, 0);
+  tbsleep(1);
+  thread[1] = spawn(reader_func, &secs);
+  tbsleep(1);
+  tbthread_rwlock_unlock(&lock);
+  tbthread_join(thread[0], 0);
+  tbthread_join(thread[1], 0);
+
+  st = memcmp(order, "rwwr", 4) == 0 ? 0 : -EINVAL;
+  if((st = check("Phases alternate", st, 0)))
+    return st;
+  return tbthread_rwlock_destroy(&lock);
+}
+
+//------------------------------------------------------------------------------
+// Test that a stream of overlapping readers lets a writer through in the
+// phase-fair mode. A writer holds the lock, a reader and a writer wait for it;
+// the reader gets a read phase and keeps it while new readers keep coming.
+// The new readers must wait for the writer.
+//------------------------------------------------------------------------------
+int stream_stop = 0;
+
+void *stream_func(void *arg)
+{
+  while(!__atomic_load_n(&stream_stop, __ATOMIC_ACQUIRE)) {
+    tbthread_rwlock_rdlock(&lock);
+    uint64_t end = tbtime_ns() + 20000000;
+    while(tbtime_ns() < end);
+    tbthread_rwlock_unlock(&lock);
+  }
+  return 0;
+}
+
+int test_reader_stream()
+{
+  tbthread_rwlockattr_t attr;
+  tbthread_t            thread[4];
+  int                   secs = 2;
+  int                   st;
+
+  tbprint("[thread main] Testing a stream of readers against a writer\n");
+  tbthread_rwlockattr_init(&attr);
+  tbthread_rwlockattr_setkind(&attr, TBTHREAD_RWLOCK_PHASE_FAIR);
+  tbthread_rwlock_init(&lock, &attr);
+
+  num_done = 0;
+  tbthread_rwlock_wrlock(&lock);
+  thread[0] = spawn(writer_func, 0);
+  tbsleep(1);
+  thread[1] = spawn(reader_func, &secs);
+  tbsleep(1);
+  tbthread_rwlock_unlock(&lock);
+  tbsleep(1);
+
+  st = tbthread_rwlock_tryrdlock(&lock);
+  if(st == 0)
+    tbthread_rwlock_unlock(&lock);
+  if((st = check("Try read lock in a read phase with a writer waiting", st,
+                 -EBUSY)))
+    return st;
+
+  thread[2] = spawn(stream_func, 0);
+  thread[3] = spawn(stream_func, 0);
+  for(int i = 0; i < 5 && num_done < 2; ++i)
+    tbsleep(1);
+  int done = num_done;
+  __atomic_store_n(&stream_stop, 1, __ATOMIC_RELEASE);
+  for(int i = 0; i < 4; ++i)
+    tbthread_join(thread[i], 0);
+
+  st = done == 2 && memcmp(order, "rw", 2) == 0 ? 0 : -EINVAL;
+  if((st = check("Writer let through", st, 0)))
+    return st;
+  return tbthread_rwlock_destroy(&lock);
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+  int st = 0;
+
+  if((st = test_upgrade()))
+    goto exit;
+  if((st = test_preference("writer preference",
+                           TBTHREAD_RWLOCK_PREFER_WRITER, -EBUSY)))
+    goto exit;
+  if((st = test_preference("reader preference",
+                           TBTHREAD_RWLOCK_PREFER_READER, 0)))
+    goto exit;
+  if((st = test_phase_fair()))
+    goto exit;
+  st = test_reader_stream();
+
+exit:
+  tbthread_finit();
+  return st;
+};
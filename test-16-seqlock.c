@@ -0,0 +1,116 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <string.h>
+
+#define READERS 4
+#define UPDATES 200000
+
+tbthread_seqlock_t lock = TBTHREAD_SEQLOCK_INIT;
+struct config {
+  uint64_t a;
+  uint64_t b;
+  uint64_t c;
+} config;
+int done = 0;
+
+//------------------------------------------------------------------------------
+// Thread functions
+//------------------------------------------------------------------------------
+void *reader_func(void *arg)
+{
+  tbthread_t    self = tbthread_self();
+  struct config copy;
+  uint64_t      reads = 0;
+  uint64_t      retries = 0;
+  uint64_t      torn = 0;
+  uint32_t      seq;
+
+  while(!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+    do {
+      seq = tbthread_seqlock_read_begin(&lock);
+      copy = config;
+      ++retries;
+    } while(tbthread_seqlock_read_retry(&lock, seq));
+    --retries;
+    ++reads;
+    if(copy.a != copy.b || copy.b != copy.c)
+      ++torn;
+  }
+
+  tbprint("[thread 0x%llx] Reads: %llu, retries: %llu, torn reads: %llu\n",
+          self, reads, retries, torn);
+  return (void *)torn;
+}
+
+void *writer_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  for(uint64_t i = 1; i <= UPDATES; ++i) {
+    tbthread_seqlock_write_lock(&lock);
+    config.a = i;
+    config.b = i;
+    config.c = i;
+    tbthread_seqlock_write_unlock(&lock);
+  }
+  tbprint("[thread 0x%llx] Updates done: %llu\n", self, config.a);
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_t       thread[READERS+1];
+  tbthread_attr_t  attr;
+  void            *ret;
+  int              st = 0;
+
+  tbthread_attr_init(&attr);
+  for(int i = 0; i < READERS+1; ++i) {
+    void *(*func)(void *) = i < READERS ? reader_func : writer_func;
+    st = tbthread_create(&thread[i], &attr, func, 0);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+  }
+
+  for(int i = 0; i < READERS+1; ++i) {
+    st = tbthread_join(thread[i], &ret);
+    if(st != 0) {
+      tbprint("Failed to join thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+    if(ret)
+      st = -EINVAL;
+  }
+
+  tbprint("[thread main] Threads joined, %s\n",
+          st ? "torn reads detected" : "no torn reads");
+
+exit:
+  tbthread_finit();
+  return st;
+};
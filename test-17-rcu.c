@@ -0,0 +1,152 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <string.h>
+
+#define READERS 4
+#define UPDATES 2000
+#define POISON  0xdeadbeef
+
+struct config {
+  struct tb_rcu_head rcu;
+  uint64_t           a;
+  uint64_t           b;
+};
+
+struct config *config;
+int done = 0;
+int freed = 0;
+
+//------------------------------------------------------------------------------
+// Free the old version; poison it first so that a reader that still sees it
+// would notice
+//------------------------------------------------------------------------------
+void free_config(struct tb_rcu_head *head)
+{
+  struct config *c = (struct config *)head;
+  c->a = POISON;
+  c->b = 0;
+  free(c);
+  __sync_fetch_and_add(&freed, 1);
+}
+
+//------------------------------------------------------------------------------
+// Thread functions
+//------------------------------------------------------------------------------
+void *reader_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  uint64_t   reads = 0;
+  uint64_t   bad = 0;
+
+  tb_rcu_thread_online();
+  while(!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+    for(int i = 0; i < 100; ++i) {
+      tb_rcu_read_lock();
+      struct config *c = tb_rcu_dereference(config);
+      if(c->a != c->b || c->a == POISON)
+        ++bad;
+      tb_rcu_read_unlock();
+      ++reads;
+    }
+    tb_rcu_quiescent_state();
+  }
+  tb_rcu_thread_offline();
+
+  tbprint("[thread 0x%llx] Reads: %llu, bad reads: %llu\n", self, reads, bad);
+  return (void *)bad;
+}
+
+void *writer_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  for(uint64_t i = 1; i <= UPDATES; ++i) {
+    struct config *c = malloc(sizeof(struct config));
+    c->a = i;
+    c->b = i;
+    struct config *old = config;
+    tb_rcu_assign_pointer(config, c);
+
+    //--------------------------------------------------------------------------
+    // Every now and then wait for the readers ourselves
+    //--------------------------------------------------------------------------
+    if(i % 100 == 0) {
+      tb_synchronize_rcu();
+      free_config(&old->rcu);
+    }
+    else
+      tb_call_rcu(&old->rcu, free_config);
+  }
+  tbprint("[thread 0x%llx] Updates done\n", self);
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_t       thread[READERS+1];
+  tbthread_attr_t  attr;
+  void            *ret;
+  int              st = 0;
+
+  config = malloc(sizeof(struct config));
+  config->a = 0;
+  config->b = 0;
+
+  tbthread_attr_init(&attr);
+  for(int i = 0; i < READERS+1; ++i) {
+    void *(*func)(void *) = i < READERS ? reader_func : writer_func;
+    st = tbthread_create(&thread[i], &attr, func, 0);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+  }
+
+  for(int i = 0; i < READERS+1; ++i) {
+    st = tbthread_join(thread[i], &ret);
+    if(st != 0) {
+      tbprint("Failed to join thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+    if(ret)
+      st = -EINVAL;
+  }
+
+  //----------------------------------------------------------------------------
+  // Wait for the reclaimer to catch up
+  //----------------------------------------------------------------------------
+  for(int i = 0; i < 10 && freed != UPDATES; ++i)
+    tbsleep(1);
+
+  tbprint("[thread main] Threads joined, %s, %d of %d versions freed\n",
+          st ? "bad reads detected" : "no bad reads", freed, UPDATES);
+  if(freed != UPDATES)
+    st = -EINVAL;
+
+exit:
+  tbthread_finit();
+  return st;
+};
@@ -0,0 +1,147 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <string.h>
+
+#define THREADS 5
+#define OPS     5000
+#define POISON  0xdeadbeef
+
+//------------------------------------------------------------------------------
+// Lock-free stack; the popped nodes are retired and freed only when nobody
+// has them published
+//------------------------------------------------------------------------------
+struct node {
+  struct node *next;
+  uint64_t     value;
+};
+
+struct node *top = 0;
+int freed = 0;
+int pushed = 0;
+
+void free_node(void *ptr)
+{
+  struct node *n = ptr;
+  n->value = POISON;
+  n->next = (struct node *)POISON;
+  free(n);
+  __sync_fetch_and_add(&freed, 1);
+}
+
+void push(uint64_t value)
+{
+  struct node *n = malloc(sizeof(struct node));
+  n->value = value;
+  do
+    n->next = top;
+  while(!__sync_bool_compare_and_swap(&top, n->next, n));
+  __sync_fetch_and_add(&pushed, 1);
+}
+
+int pop(uint64_t *value)
+{
+  struct node *n;
+  while(1) {
+    n = tb_hazard_protect(0, (void **)&top);
+    if(!n)
+      return 0;
+    if(__sync_bool_compare_and_swap(&top, n, n->next))
+      break;
+  }
+  tb_hazard_clear(0);
+  *value = n->value;
+  tb_hazard_retire(n, free_node);
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+// Thread function
+//------------------------------------------------------------------------------
+void *thread_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  uint64_t   popped = 0;
+  uint64_t   bad = 0;
+  uint64_t   value;
+
+  for(int i = 0; i < OPS; ++i) {
+    push(i);
+    if(i % 2 && pop(&value)) {
+      ++popped;
+      if(value == POISON)
+        ++bad;
+    }
+  }
+  while(pop(&value)) {
+    ++popped;
+    if(value == POISON)
+      ++bad;
+  }
+
+  tbprint("[thread 0x%llx] Popped: %llu, bad values: %llu\n", self, popped,
+          bad);
+  return (void *)bad;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_t       thread[THREADS];
+  tbthread_attr_t  attr;
+  void            *ret;
+  int              st = 0;
+
+  tbthread_attr_init(&attr);
+  for(int i = 0; i < THREADS; ++i) {
+    st = tbthread_create(&thread[i], &attr, thread_func, 0);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+  }
+
+  for(int i = 0; i < THREADS; ++i) {
+    st = tbthread_join(thread[i], &ret);
+    if(st != 0) {
+      tbprint("Failed to join thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+    if(ret)
+      st = -EINVAL;
+  }
+
+  //----------------------------------------------------------------------------
+  // Whatever the threads could not free on exit is ours now
+  //----------------------------------------------------------------------------
+  tb_hazard_scan();
+  tbprint("[thread main] Threads joined, %s, %d of %d nodes freed\n",
+          st ? "bad values detected" : "no bad values", freed, pushed);
+  if(freed != pushed)
+    st = -EINVAL;
+
+exit:
+  tbthread_finit();
+  return st;
+};
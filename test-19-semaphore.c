@@ -0,0 +1,130 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <string.h>
+#include <linux/time.h>
+
+#define CONSUMERS 4
+#define ITEMS     3000
+#define BATCH     3
+
+tbthread_sem_t items = TBTHREAD_SEM_INIT(0);
+int consumed = 0;
+
+//------------------------------------------------------------------------------
+// Thread functions; the consumers take single items or batches
+//------------------------------------------------------------------------------
+void *consumer_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  int        batch = *(int *)arg;
+  int        num = 0;
+
+  for(int i = 0; i < ITEMS/CONSUMERS/batch; ++i) {
+    if(batch == 1)
+      tbthread_sem_wait(&items);
+    else
+      tbthread_sem_wait_n(&items, batch);
+    num += batch;
+  }
+  __sync_fetch_and_add(&consumed, num);
+  tbprint("[thread 0x%llx] Consumed %d items in batches of %d\n", self, num,
+          batch);
+  return 0;
+}
+
+void *producer_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  for(int i = 0; i < ITEMS; i += 5) {
+    tbthread_sem_post_n(&items, 5);
+    if(i % 100 == 0)
+      SYSCALL0(__NR_sched_yield);
+  }
+  tbprint("[thread 0x%llx] Produced %d items\n", self, ITEMS);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_t       thread[CONSUMERS+1];
+  int              batch[CONSUMERS] = {1, BATCH, 1, BATCH};
+  tbthread_attr_t  attr;
+  struct timespec  ts;
+  int              st = 0;
+
+  //----------------------------------------------------------------------------
+  // Non-blocking and timed waits on an empty semaphore
+  //----------------------------------------------------------------------------
+  st = tbthread_sem_trywait(&items);
+  tbprint("[thread main] Try wait: %s\n", tbstrerror(-st));
+  if(st != -EAGAIN)
+    goto error;
+
+  SYSCALL2(__NR_clock_gettime, CLOCK_REALTIME, &ts);
+  ts.tv_sec += 1;
+  st = tbthread_sem_timedwait(&items, &ts);
+  tbprint("[thread main] Timed wait: %s\n", tbstrerror(-st));
+  if(st != -ETIMEDOUT)
+    goto error;
+
+  //----------------------------------------------------------------------------
+  // Producer and consumers
+  //----------------------------------------------------------------------------
+  tbthread_attr_init(&attr);
+  for(int i = 0; i < CONSUMERS+1; ++i) {
+    if(i < CONSUMERS)
+      st = tbthread_create(&thread[i], &attr, consumer_func, &batch[i]);
+    else
+      st = tbthread_create(&thread[i], &attr, producer_func, 0);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+  }
+
+  for(int i = 0; i < CONSUMERS+1; ++i) {
+    st = tbthread_join(thread[i], 0);
+    if(st != 0) {
+      tbprint("Failed to join thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+  }
+
+  int left;
+  tbthread_sem_getvalue(&items, &left);
+  tbprint("[thread main] Threads joined, consumed: %d, left: %d\n", consumed,
+          left);
+  if(consumed + left != ITEMS)
+    goto error;
+  st = tbthread_sem_destroy(&items);
+  goto exit;
+
+error:
+  st = -EINVAL;
+exit:
+  tbthread_finit();
+  return st;
+};
@@ -0,0 +1,131 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+
+#define THREADS 9
+#define PHASES  50
+
+tbthread_barrier_t barrier;
+int use_id = 0;
+int arrived[PHASES];
+int serial[PHASES];
+int bad = 0;
+
+//------------------------------------------------------------------------------
+// Thread function; everybody must have arrived at a phase before anybody
+// leaves it
+//------------------------------------------------------------------------------
+void *thread_func(void *arg)
+{
+  int num = *(int *)arg;
+  for(int i = 0; i < PHASES; ++i) {
+    __sync_fetch_and_add(&arrived[i], 1);
+    int st;
+    if(use_id)
+      st = tbthread_barrier_wait_id(&barrier, num);
+    else
+      st = tbthread_barrier_wait(&barrier);
+    if(st == TBTHREAD_BARRIER_SERIAL_THREAD)
+      __sync_fetch_and_add(&serial[i], 1);
+    else if(st != 0)
+      __sync_fetch_and_add(&bad, 1);
+    if(__atomic_load_n(&arrived[i], __ATOMIC_ACQUIRE) != THREADS)
+      __sync_fetch_and_add(&bad, 1);
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Run the threads through the barrier
+//------------------------------------------------------------------------------
+int run(const char *name, int kind, int spin, int with_id)
+{
+  tbthread_t             thread[THREADS];
+  int                    targ[THREADS];
+  tbthread_attr_t        attr;
+  tbthread_barrierattr_t battr;
+  int                    st = 0;
+
+  for(int i = 0; i < PHASES; ++i)
+    arrived[i] = serial[i] = 0;
+  bad = 0;
+  use_id = with_id;
+
+  tbthread_barrierattr_init(&battr);
+  tbthread_barrierattr_setkind(&battr, kind);
+  tbthread_barrierattr_setspin(&battr, spin);
+  st = tbthread_barrier_init(&barrier, &battr, THREADS);
+  if(st != 0) {
+    tbprint("Failed to initialize the barrier: %s\n", tbstrerror(-st));
+    return st;
+  }
+
+  tbthread_attr_init(&attr);
+  for(int i = 0; i < THREADS; ++i) {
+    targ[i] = i;
+    st = tbthread_create(&thread[i], &attr, thread_func, &targ[i]);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      return st;
+    }
+  }
+
+  for(int i = 0; i < THREADS; ++i)
+    tbthread_join(thread[i], 0);
+  tbthread_barrier_destroy(&barrier);
+
+  for(int i = 0; i < PHASES; ++i)
+    if(serial[i] != 1)
+      ++bad;
+
+  tbprint("[thread main] %s: %s (%d errors)\n", name, bad ? "FAILED" : "OK",
+          bad);
+  return bad ? -EINVAL : 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_barrier_t b;
+  int st = tbthread_barrier_init(&b, 0, 0);
+  tbprint("[thread main] Zero count: %s\n",
+          st == -EINVAL ? "rejected" : "ACCEPTED");
+  if(st != -EINVAL) {
+    st = -EINVAL;
+    goto exit;
+  }
+
+  if((st = run("central, spinning", TBTHREAD_BARRIER_CENTRAL, 1000, 0)))
+    goto exit;
+  if((st = run("central, parking", TBTHREAD_BARRIER_CENTRAL, 0, 0)))
+    goto exit;
+  if((st = run("tree, tickets", TBTHREAD_BARRIER_TREE, 100, 0)))
+    goto exit;
+  if((st = run("tree, explicit ids", TBTHREAD_BARRIER_TREE, 100, 1)))
+    goto exit;
+
+exit:
+  tbthread_finit();
+  return st;
+};
@@ -0,0 +1,114 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+
+#define WORKERS 6
+#define ROUNDS  20
+
+tbthread_latch_t start = TBTHREAD_LATCH_INIT(1);
+tbthread_waitgroup_t wg = TBTHREAD_WAITGROUP_INIT;
+int results[WORKERS];
+int phase = 0;
+
+//------------------------------------------------------------------------------
+// Worker; waits for the start signal and then does one task per phase
+//------------------------------------------------------------------------------
+void *worker_func(void *arg)
+{
+  int num = *(int *)arg;
+  tbthread_latch_wait(&start);
+  for(int i = 1; i <= ROUNDS; ++i) {
+    while(__atomic_load_n(&phase, __ATOMIC_ACQUIRE) < i)
+      SYSCALL0(__NR_sched_yield);
+    for(uint64_t z = 0; z < 100000ULL; ++z);
+    results[num] = i;
+    tbthread_waitgroup_done(&wg);
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_t      thread[WORKERS];
+  int             targ[WORKERS];
+  tbthread_attr_t attr;
+  int             st = 0;
+  int             bad = 0;
+
+  //----------------------------------------------------------------------------
+  // Error paths
+  //----------------------------------------------------------------------------
+  tbthread_latch_t latch;
+  tbthread_latch_init(&latch, 2);
+  if(tbthread_latch_trywait(&latch) != -EAGAIN)
+    ++bad;
+  tbthread_latch_count_down_n(&latch, 2);
+  if(tbthread_latch_trywait(&latch) != 0)
+    ++bad;
+  if(tbthread_latch_count_down(&latch) != -EINVAL)
+    ++bad;
+  if(tbthread_latch_wait(&latch) != 0)
+    ++bad;
+  if(tbthread_waitgroup_done(&wg) != -EINVAL)
+    ++bad;
+  if(tbthread_waitgroup_wait(&wg) != 0)
+    ++bad;
+  tbprint("[thread main] Error paths: %s\n", bad ? "FAILED" : "OK");
+
+  //----------------------------------------------------------------------------
+  // Fan out and in a couple of times
+  //----------------------------------------------------------------------------
+  tbthread_attr_init(&attr);
+  for(int i = 0; i < WORKERS; ++i) {
+    targ[i] = i;
+    st = tbthread_create(&thread[i], &attr, worker_func, &targ[i]);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+  }
+
+  tbthread_latch_count_down(&start);
+  for(int i = 1; i <= ROUNDS; ++i) {
+    tbthread_waitgroup_add(&wg, WORKERS);
+    __atomic_store_n(&phase, i, __ATOMIC_RELEASE);
+    tbthread_waitgroup_wait(&wg);
+    for(int j = 0; j < WORKERS; ++j)
+      if(results[j] != i)
+        ++bad;
+  }
+
+  for(int i = 0; i < WORKERS; ++i)
+    tbthread_join(thread[i], 0);
+
+  tbprint("[thread main] Fan-out and fan-in: %s (%d errors)\n",
+          bad ? "FAILED" : "OK", bad);
+  if(bad)
+    st = -EINVAL;
+
+exit:
+  tbthread_finit();
+  return st;
+};
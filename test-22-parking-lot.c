@@ -0,0 +1,163 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+
+#define THREADS 6
+#define OPS     20000
+
+tbthread_bytelock_t bytelock = TBTHREAD_BYTELOCK_INIT;
+uint32_t bits = 0;
+int byte_counter = 0;
+int bit_counters[4];
+int flag = 0;
+int woken = 0;
+
+//------------------------------------------------------------------------------
+// Hammer the locks; yield in the critical section from time to time so that
+// the others have to park
+//------------------------------------------------------------------------------
+void *lock_func(void *arg)
+{
+  int num = *(int *)arg;
+  for(int i = 0; i < OPS; ++i) {
+    tbthread_bytelock_lock(&bytelock);
+    ++byte_counter;
+    if(i % 1000 == 0)
+      SYSCALL0(__NR_sched_yield);
+    tbthread_bytelock_unlock(&bytelock);
+
+    int bit = (num + i) % 4;
+    tbthread_bitlock_lock(&bits, bit);
+    ++bit_counters[bit];
+    if(i % 1000 == 0)
+      SYSCALL0(__NR_sched_yield);
+    tbthread_bitlock_unlock(&bits, bit);
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Wait for the flag
+//------------------------------------------------------------------------------
+void *wait_func(void *arg)
+{
+  while(!__atomic_load_n(&flag, __ATOMIC_ACQUIRE))
+    tb_atomic_wait(&flag, 0);
+  __sync_fetch_and_add(&woken, 1);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Run the threads
+//------------------------------------------------------------------------------
+int run(void *(*func)(void *))
+{
+  tbthread_t      thread[THREADS];
+  int             targ[THREADS];
+  tbthread_attr_t attr;
+  int             st = 0;
+
+  tbthread_attr_init(&attr);
+  for(int i = 0; i < THREADS; ++i) {
+    targ[i] = i;
+    st = tbthread_create(&thread[i], &attr, func, &targ[i]);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      return st;
+    }
+  }
+
+  if(func == wait_func) {
+    tbsleep(1);
+    __atomic_store_n(&flag, 1, __ATOMIC_RELEASE);
+    int num = tb_atomic_notify_all(&flag);
+    tbprint("[thread main] Notified %d waiters\n", num);
+  }
+
+  for(int i = 0; i < THREADS; ++i)
+    tbthread_join(thread[i], 0);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  int st = 0;
+  int bad = 0;
+
+  //----------------------------------------------------------------------------
+  // Uncontended paths
+  //----------------------------------------------------------------------------
+  if(tb_atomic_wait(&flag, 1) != -EAGAIN)
+    ++bad;
+  if(tb_atomic_notify_one(&flag) != 0)
+    ++bad;
+  if(tbthread_bytelock_unlock(&bytelock) != -EPERM)
+    ++bad;
+  if(tbthread_bytelock_trylock(&bytelock) != 0)
+    ++bad;
+  if(tbthread_bytelock_trylock(&bytelock) != -EBUSY)
+    ++bad;
+  tbthread_bytelock_unlock(&bytelock);
+  if(tbthread_bitlock_trylock(&bits, 3) != 0 || bits != 0x08)
+    ++bad;
+  if(tbthread_bitlock_trylock(&bits, 3) != -EBUSY)
+    ++bad;
+  tbthread_bitlock_unlock(&bits, 3);
+  if(tbthread_bitlock_unlock(&bits, 3) != -EPERM || bits != 0)
+    ++bad;
+  tbprint("[thread main] Uncontended paths: %s\n", bad ? "FAILED" : "OK");
+
+  //----------------------------------------------------------------------------
+  // Contended locks
+  //----------------------------------------------------------------------------
+  if((st = run(lock_func)))
+    goto exit;
+
+  int bit_total = 0;
+  for(int i = 0; i < 4; ++i)
+    bit_total += bit_counters[i];
+  tbprint("[thread main] Byte lock counter: %d, bit lock counters: %d, "
+          "expected: %d\n", byte_counter, bit_total, THREADS * OPS);
+  if(byte_counter != THREADS * OPS || bit_total != THREADS * OPS ||
+     bytelock.state != 0 || bits != 0)
+    ++bad;
+
+  //----------------------------------------------------------------------------
+  // Atomic wait
+  //----------------------------------------------------------------------------
+  if((st = run(wait_func)))
+    goto exit;
+  tbprint("[thread main] Woken threads: %d\n", woken);
+  if(woken != THREADS)
+    ++bad;
+
+  tbprint("[thread main] %s\n", bad ? "FAILED" : "OK");
+  if(bad)
+    st = -EINVAL;
+
+exit:
+  tbthread_finit();
+  return st;
+};
@@ -0,0 +1,148 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <linux/time.h>
+
+#define POSTS 50
+
+tbthread_sem_t sem_a = TBTHREAD_SEM_INIT(0);
+tbthread_sem_t sem_b = TBTHREAD_SEM_INIT(0);
+tbthread_latch_t done = TBTHREAD_LATCH_INIT(1);
+int received[2];
+
+//------------------------------------------------------------------------------
+// Producer
+//------------------------------------------------------------------------------
+void *producer_func(void *arg)
+{
+  tbthread_sem_t *sem = arg;
+  for(int i = 0; i < POSTS; ++i) {
+    tbthread_sem_post(sem);
+    if(i % 10 == 0)
+      SYSCALL0(__NR_sched_yield);
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Dispatcher; sleeps on both semaphores and the latch at once
+//------------------------------------------------------------------------------
+void *dispatcher_func(void *arg)
+{
+  tb_wait_item_t items[] = {
+    {TBTHREAD_WAIT_SEM, &sem_a},
+    {TBTHREAD_WAIT_SEM, &sem_b},
+    {TBTHREAD_WAIT_LATCH, &done}};
+
+  while(1) {
+    int st = tb_wait_any(items, 3, 0);
+    if(st == 2)
+      break;
+    if(st < 0) {
+      tbprint("[dispatcher] Wait failed: %s\n", tbstrerror(-st));
+      return (void *)1;
+    }
+    ++received[st];
+  }
+
+  while(tbthread_sem_trywait(&sem_a) == 0)
+    ++received[0];
+  while(tbthread_sem_trywait(&sem_b) == 0)
+    ++received[1];
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_t      dispatcher, producer[2];
+  tbthread_attr_t attr;
+  struct timespec ts;
+  int             st = 0;
+  int             bad = 0;
+
+  //----------------------------------------------------------------------------
+  // Ready items, bad arguments and timeouts
+  //----------------------------------------------------------------------------
+  tbthread_sem_t   sem;
+  tbthread_latch_t latch;
+  tbthread_sem_init(&sem, 0);
+  tbthread_latch_init(&latch, 1);
+  tb_wait_item_t items[] = {
+    {TBTHREAD_WAIT_LATCH, &latch},
+    {TBTHREAD_WAIT_SEM, &sem}};
+
+  tbthread_sem_post(&sem);
+  if(tb_wait_any(items, 2, 0) != 1 || tbthread_sem_trywait(&sem) != -EAGAIN)
+    ++bad;
+  if(tb_wait_any(items, 0, 0) != -EINVAL)
+    ++bad;
+
+  SYSCALL2(__NR_clock_gettime, CLOCK_REALTIME, &ts);
+  ts.tv_nsec += 200000000;
+  if(ts.tv_nsec >= 1000000000) {
+    ts.tv_nsec -= 1000000000;
+    ++ts.tv_sec;
+  }
+  if(tb_wait_any(items, 2, &ts) != -ETIMEDOUT)
+    ++bad;
+  int value;
+  tbthread_sem_getvalue(&sem, &value);
+  if(value != 0 || tbthread_sem_destroy(&sem) != 0)
+    ++bad;
+  tbthread_latch_count_down(&latch);
+  if(tb_wait_any(items, 2, 0) != 0)
+    ++bad;
+  tbprint("[thread main] Single-threaded paths: %s\n", bad ? "FAILED" : "OK");
+
+  //----------------------------------------------------------------------------
+  // A dispatcher and two producers
+  //----------------------------------------------------------------------------
+  tbthread_attr_init(&attr);
+  if((st = tbthread_create(&dispatcher, &attr, dispatcher_func, 0)))
+    goto exit;
+  if((st = tbthread_create(&producer[0], &attr, producer_func, &sem_a)))
+    goto exit;
+  if((st = tbthread_create(&producer[1], &attr, producer_func, &sem_b)))
+    goto exit;
+
+  tbthread_join(producer[0], 0);
+  tbthread_join(producer[1], 0);
+  tbthread_latch_count_down(&done);
+
+  void *ret;
+  tbthread_join(dispatcher, &ret);
+  tbprint("[thread main] Dispatched: %d + %d, expected: %d + %d\n",
+          received[0], received[1], POSTS, POSTS);
+  if(ret || received[0] != POSTS || received[1] != POSTS)
+    ++bad;
+
+  tbprint("[thread main] %s\n", bad ? "FAILED" : "OK");
+  if(bad)
+    st = -EINVAL;
+
+exit:
+  tbthread_finit();
+  return st;
+};
@@ -0,0 +1,178 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <linux/resource.h>
+
+#define SMALL_THREADS 200
+#define LAZY_THREADS  100
+#define LAZY_STACK    (64 * 1024 * 1024)
+#define USER_STACK    (64 * 1024)
+#define BUFFER        (128 * 1024)
+
+#define RUSAGE_THREAD 1
+
+//------------------------------------------------------------------------------
+// Use some stack
+//------------------------------------------------------------------------------
+void *small_func(void *arg)
+{
+  volatile char buffer[8192];
+  for(int i = 0; i < sizeof(buffer); ++i)
+    buffer[i] = i;
+  int sum = 0;
+  for(int i = 0; i < sizeof(buffer); ++i)
+    sum += buffer[i];
+  return (void *)(long)sum;
+}
+
+//------------------------------------------------------------------------------
+// Tell whether we run on the stack supplied by the user
+//------------------------------------------------------------------------------
+char *user_stack = 0;
+void *where_func(void *arg)
+{
+  volatile char local = 0;
+  char *where = (char *)&local;
+  return (void *)(long)(where >= user_stack && where < user_stack + USER_STACK);
+}
+
+//------------------------------------------------------------------------------
+// Count the page faults taken while touching the stack
+//------------------------------------------------------------------------------
+void *fault_func(void *arg)
+{
+  volatile char buffer[BUFFER];
+  struct rusage before, after;
+  SYSCALL2(__NR_getrusage, RUSAGE_THREAD, &before);
+  for(int i = 0; i < sizeof(buffer); i += 1024)
+    buffer[i] = i;
+  SYSCALL2(__NR_getrusage, RUSAGE_THREAD, &after);
+  return (void *)(after.ru_minflt - before.ru_minflt);
+}
+
+//------------------------------------------------------------------------------
+// Run some threads and collect what they return
+//------------------------------------------------------------------------------
+int run(tbthread_attr_t *attr, int num, void *(*func)(void *), void **ret)
+{
+  tbthread_t thread[SMALL_THREADS];
+  int st;
+  for(int i = 0; i < num; ++i) {
+    if((st = tbthread_create(&thread[i], attr, func, 0))) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      return st;
+    }
+  }
+  for(int i = 0; i < num; ++i)
+    tbthread_join(thread[i], &ret[i]);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_attr_t  attr;
+  void            *ret[SMALL_THREADS];
+  int              st = 0;
+  int              bad = 0;
+
+  //----------------------------------------------------------------------------
+  // Invalid attributes
+  //----------------------------------------------------------------------------
+  tbthread_attr_init(&attr);
+  if(tbthread_attr_setstacksize(&attr, TBTHREAD_STACK_MIN - 1) != -EINVAL ||
+     tbthread_attr_setstack(&attr, 0, USER_STACK) != -EINVAL ||
+     tbthread_attr_setstackmode(&attr, 42) != -EINVAL) {
+    tbprint("[thread main] Invalid stack attributes accepted\n");
+    ++bad;
+  }
+
+  //----------------------------------------------------------------------------
+  // Small stacks with big guards
+  //----------------------------------------------------------------------------
+  tbthread_attr_setstacksize(&attr, TBTHREAD_STACK_MIN + 1);
+  tbthread_attr_setguardsize(&attr, 2 * 4096);
+  if((st = run(&attr, SMALL_THREADS, small_func, ret)))
+    goto exit;
+  int expected = (long)small_func(0);
+  int wrong = 0;
+  for(int i = 0; i < SMALL_THREADS; ++i)
+    if((long)ret[i] != expected)
+      ++wrong;
+  tbprint("[thread main] Small stacks: %d threads, %d wrong results\n",
+          SMALL_THREADS, wrong);
+  if(wrong)
+    ++bad;
+
+  //----------------------------------------------------------------------------
+  // User supplied stack, used twice
+  //----------------------------------------------------------------------------
+  user_stack = malloc(USER_STACK);
+  tbthread_attr_init(&attr);
+  tbthread_attr_setstack(&attr, user_stack, USER_STACK);
+  for(int i = 0; i < 2; ++i) {
+    if((st = run(&attr, 1, where_func, ret)))
+      goto exit;
+    int inside = (long)ret[0];
+    tbprint("[thread main] User stack, run %d: local variable %s the stack\n",
+            i, inside ? "inside" : "outside");
+    if(!inside)
+      ++bad;
+  }
+  free(user_stack);
+
+  //----------------------------------------------------------------------------
+  // Lots of big lazily committed stacks
+  //----------------------------------------------------------------------------
+  tbthread_attr_init(&attr);
+  tbthread_attr_setstacksize(&attr, LAZY_STACK);
+  tbthread_attr_setstackmode(&attr, TBTHREAD_STACK_NORESERVE);
+  if((st = run(&attr, LAZY_THREADS, small_func, ret)))
+    goto exit;
+  tbprint("[thread main] Lazy stacks: %d threads with %d MB stacks\n",
+          LAZY_THREADS, LAZY_STACK / (1024 * 1024));
+
+  //----------------------------------------------------------------------------
+  // Prefaulted stacks, a fresh one and one from the cache
+  //----------------------------------------------------------------------------
+  tbthread_attr_init(&attr);
+  tbthread_attr_setstacksize(&attr, 2 * BUFFER);
+  tbthread_attr_setstackmode(&attr, TBTHREAD_STACK_POPULATE);
+  for(int i = 0; i < 2; ++i) {
+    if((st = run(&attr, 1, fault_func, ret)))
+      goto exit;
+    tbprint("[thread main] Populated stack, run %d: %d page faults\n", i,
+            (int)(long)ret[0]);
+    if(ret[0])
+      ++bad;
+  }
+
+  tbprint("[thread main] %s\n", bad ? "FAILED" : "OK");
+  if(bad)
+    st = -EINVAL;
+
+exit:
+  tbthread_finit();
+  return st;
+};
@@ -0,0 +1,124 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+#include <tb.h>
+#include <linux/fcntl.h>
+
+#define THREADS 50
+
+//------------------------------------------------------------------------------
+// The stacks that the cache may keep: 40 MB of the default 8 MB ones, each
+// mapped as the stack and its guard, plus some slack for the memory
+// allocator
+//------------------------------------------------------------------------------
+#define MAPS_SLACK (2 * 5 + 4)
+
+int go = 0;
+int done = 0;
+
+//------------------------------------------------------------------------------
+// Count the mappings of the process
+//------------------------------------------------------------------------------
+int count_maps()
+{
+  char buffer[4096];
+  int  num = 0;
+  long ret;
+  int  fd = SYSCALL3(__NR_open, "/proc/self/maps", O_RDONLY, 0);
+  if(fd < 0)
+    return fd;
+  while((ret = SYSCALL3(__NR_read, fd, buffer, sizeof(buffer))) > 0)
+    for(int i = 0; i < ret; ++i)
+      if(buffer[i] == '\n')
+        ++num;
+  SYSCALL1(__NR_close, fd);
+  return num;
+}
+
+//------------------------------------------------------------------------------
+// Thread function; all the threads are alive at the same time, so that no
+// new thread takes the slot of one that has exited
+//------------------------------------------------------------------------------
+void *thread_func(void *arg)
+{
+  while(!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+    SYSCALL0(__NR_sched_yield);
+  __sync_fetch_and_add(&done, 1);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_t      thread;
+  tbthread_attr_t attr;
+  int             st = 0;
+
+  int before = count_maps();
+  tbprint("[thread main] %d mappings before spawning\n", before);
+
+  //----------------------------------------------------------------------------
+  // Spawn the detached threads and give them time to exit
+  //----------------------------------------------------------------------------
+  tbthread_attr_init(&attr);
+  tbthread_attr_setdetachstate(&attr, TBTHREAD_CREATE_DETACHED);
+  for(int i = 0; i < THREADS; ++i) {
+    st = tbthread_create(&thread, &attr, thread_func, 0);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+  }
+
+  __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+  while(__atomic_load_n(&done, __ATOMIC_ACQUIRE) != THREADS)
+    SYSCALL0(__NR_sched_yield);
+  tbsleep(1);
+  tbprint("[thread main] %d detached threads done, %d mappings\n", THREADS,
+          count_maps());
+
+  //----------------------------------------------------------------------------
+  // Joining a thread gives back the stacks of the detached ones
+  //----------------------------------------------------------------------------
+  tbthread_attr_init(&attr);
+  __atomic_store_n(&done, 0, __ATOMIC_RELEASE);
+  st = tbthread_create(&thread, &attr, thread_func, 0);
+  if(st != 0) {
+    tbprint("Failed to spawn the joinable thread: %s\n", tbstrerror(-st));
+    goto exit;
+  }
+  tbthread_join(thread, 0);
+
+  int after = count_maps();
+  tbprint("[thread main] %d mappings after joining\n", after);
+  if(after - before > MAPS_SLACK) {
+    tbprint("[thread main] FAILED: the stacks of the detached threads are "
+            "still mapped\n");
+    st = -EINVAL;
+  }
+  else
+    tbprint("[thread main] OK\n");
+
+exit:
+  tbthread_finit();
+  return st;
+};